@@ -0,0 +1,519 @@
+// Headless benchmark for the grain engine. Drives GrainMixer from the different kinds of
+// sources across grain rates, pitches, source channel counts, grain channel counts, output
+// layouts and polyphonic voice counts and reports the average cost per output sample, the
+// worst block time as a percentage of the block's real time duration and any memory
+// allocations made while processing. Also measures how much of a sine pitched above the
+// Nyquist frequency aliases back into a grain. Exits with 1 if the processing allocated
+// memory after the warm up, a block took longer than the budget or a grain aliased more
+// than allowed.
+//
+// Build and run with : make -C bench RACK_DIR=<path to Rack SDK> &&
+//   bench/grainbench [seconds] [block budget percent]
+
+#define DR_WAV_IMPLEMENTATION
+#include "../src/grain_engine/dr_wav.h"
+#include "../src/grain_engine/drwav_source.h"
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+Plugin* pluginInstance = nullptr;
+
+static thread_local bool g_countAllocations = false;
+static std::atomic<int> g_allocationCount{0};
+
+static void countAllocation()
+{
+    if (g_countAllocations)
+        ++g_allocationCount;
+}
+
+// The WDL resampler allocates with malloc and realloc, so with glibc those are counted
+// directly. new goes through malloc then. Not with the sanitizers, which replace malloc.
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+extern "C" void* __libc_malloc(std::size_t sz);
+extern "C" void* __libc_realloc(void* p, std::size_t sz);
+extern "C" void* __libc_calloc(std::size_t n, std::size_t sz);
+extern "C" void* malloc(std::size_t sz)
+{
+    countAllocation();
+    return __libc_malloc(sz);
+}
+extern "C" void* realloc(void* p, std::size_t sz)
+{
+    countAllocation();
+    return __libc_realloc(p,sz);
+}
+extern "C" void* calloc(std::size_t n, std::size_t sz)
+{
+    countAllocation();
+    return __libc_calloc(n,sz);
+}
+static const bool g_mallocCounted = true;
+#else
+static const bool g_mallocCounted = false;
+#endif
+
+// not inlined, so the compiler doesn't see through to malloc and free and warn about them
+__attribute__((noinline)) void* operator new(std::size_t sz)
+{
+    if (!g_mallocCounted)
+        countAllocation();
+    void* p = std::malloc(sz == 0 ? 1 : sz);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+// Stands in for ImgSynth, which serves its rendered output buffer as a span in the same way.
+// ImgSynth itself needs the image and scale loading of its module, so it isn't built here.
+class RenderedBufferSource : public GrainAudioSource
+{
+public:
+    RenderedBufferSource(int numFrames, int numChannels, float sampleRate)
+        : m_numFrames(numFrames), m_numChannels(numChannels), m_sampleRate(sampleRate)
+    {
+        m_buf.resize(numFrames*numChannels);
+        for (int i=0;i<numFrames;++i)
+        {
+            for (int j=0;j<numChannels;++j)
+            {
+                float sum = 0.0f;
+                for (int k=1;k<8;++k)
+                    sum += std::sin(2*3.141592653*110.0*k*(j+1)*i/sampleRate)/k;
+                m_buf[i*numChannels+j] = sum*0.25f;
+            }
+        }
+    }
+    float getSourceSampleRate() override { return m_sampleRate; }
+    int getSourceNumSamples() override { return m_numFrames; }
+    int getSourceNumChannels() override { return m_numChannels; }
+    void putIntoBuffer(float* dest, int frames, int channels, int startInSource) override
+    {
+        for (int i=0;i<frames;++i)
+        {
+            int index = i+startInSource;
+            for (int j=0;j<channels;++j)
+            {
+                if (index>=0 && index<m_numFrames)
+                    dest[i*channels+j] = m_buf[index*m_numChannels+mapSourceChannel(m_numChannels,j)];
+                else dest[i*channels+j] = 0.0f;
+            }
+        }
+    }
+    bool acquireSourceSpan(GrainSourceSpan& span) override
+    {
+        span.data = m_buf.data();
+        span.numFrames = m_numFrames;
+        span.numChannels = m_numChannels;
+        return true;
+    }
+private:
+    std::vector<float> m_buf;
+    int m_numFrames = 0;
+    int m_numChannels = 0;
+    float m_sampleRate = 44100.0f;
+};
+
+// A sine that can be read in place, so the grains take the span path where they may
+class SineSource : public GrainAudioSource
+{
+public:
+    SineSource(float freq, int numFrames, float sampleRate) : m_sampleRate(sampleRate)
+    {
+        m_buf.resize(numFrames);
+        for (int i=0;i<numFrames;++i)
+            m_buf[i] = std::sin(2*3.141592653*freq*i/sampleRate);
+    }
+    float getSourceSampleRate() override { return m_sampleRate; }
+    int getSourceNumSamples() override { return m_buf.size(); }
+    int getSourceNumChannels() override { return 1; }
+    void putIntoBuffer(float* dest, int frames, int channels, int startInSource) override
+    {
+        for (int i=0;i<frames;++i)
+        {
+            int index = i+startInSource;
+            float sample = index>=0 && index<(int)m_buf.size() ? m_buf[index] : 0.0f;
+            for (int j=0;j<channels;++j)
+                dest[i*channels+j] = sample;
+        }
+    }
+    bool acquireSourceSpan(GrainSourceSpan& span) override
+    {
+        span.data = m_buf.data();
+        span.numFrames = m_buf.size();
+        span.numChannels = 1;
+        return true;
+    }
+private:
+    std::vector<float> m_buf;
+    float m_sampleRate = 44100.0f;
+};
+
+// Level of a half second grain of a full scale sine, in dB relative to the grain window
+// applied to the sine without pitching. Sines pitched above the Nyquist frequency should
+// come out much quieter, whatever is left of them is aliasing.
+static double measureGrainLevel(float freq, float pitch, float sampleRate)
+{
+    SineSource src(freq,sampleRate*2,sampleRate);
+    ISGrain grain;
+    grain.m_syn = &src;
+    grain.setSampleRate(sampleRate);
+    grain.setNumOutChans(1);
+    const float len = 0.5f;
+    grain.initGrain(src.getSourceNumSamples(),sampleRate*0.5f,len,pitch);
+    const int lensamples = sampleRate*len;
+    std::vector<float> out(lensamples,0.0f);
+    grain.mix<1>(out.data(),lensamples,lensamples);
+    double energy = 0.0;
+    double reference = 0.0;
+    for (int i=0;i<lensamples;++i)
+    {
+        float win = 0.5f * (1.0f - std::cos(2.0f * 3.141592653 * i/(lensamples-1)));
+        energy += out[i]*out[i];
+        // mean square of the windowed sine
+        reference += win*win*0.5;
+    }
+    return 10.0*std::log10(std::max(energy,1.0e-20)/reference);
+}
+
+static DrWavBuffer* makeTestBuffer(drwav_uint64 numFrames, unsigned int channels, unsigned int sampleRate,
+    DrWavBuffer::Storage storage)
+{
+    DrWavBuffer* buf = new DrWavBuffer(numFrames,channels,sampleRate,storage);
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> dist(-0.5f,0.5f);
+    std::vector<float> frame(channels);
+    for (drwav_uint64 i=0;i<numFrames;++i)
+    {
+        for (unsigned int j=0;j<channels;++j)
+            frame[j] = dist(rng)+0.4f*std::sin(2*3.141592653*220.0*(j+1)*i/sampleRate);
+        buf->writeFrames(i,frame.data(),1);
+    }
+    return buf;
+}
+
+// 24 bit files can't be read in place, so grains from them go through putIntoBuffer
+static bool writeTestWav24(std::string filename, drwav_uint64 numFrames, unsigned int channels,
+    unsigned int sampleRate)
+{
+    drwav_data_format format;
+    format.container = drwav_container_riff;
+    format.format = DR_WAVE_FORMAT_PCM;
+    format.channels = channels;
+    format.sampleRate = sampleRate;
+    format.bitsPerSample = 24;
+    drwav wav;
+    if (!drwav_init_file_write(&wav,filename.c_str(),&format,nullptr))
+        return false;
+    std::unique_ptr<DrWavBuffer> src(makeTestBuffer(numFrames,channels,sampleRate,DrWavBuffer::ST_Float));
+    std::vector<unsigned char> packed(numFrames*channels*3);
+    for (drwav_uint64 i=0;i<numFrames*channels;++i)
+    {
+        int32_t x = std::max(-8388608.0f,std::min(8388607.0f,std::round(src->data()[i]*8388608.0f)));
+        packed[i*3+0] = x & 0xff;
+        packed[i*3+1] = (x >> 8) & 0xff;
+        packed[i*3+2] = (x >> 16) & 0xff;
+    }
+    drwav_uint64 written = drwav_write_pcm_frames(&wav,numFrames,packed.data());
+    drwav_uninit(&wav);
+    return written == numFrames;
+}
+
+struct BenchResult
+{
+    double nsPerSample = 0.0;
+    double worstBlockMicros = 0.0;
+    // of the block's duration at the sample rate
+    double worstBlockPercent = 0.0;
+    // the WDL resampler grows its buffers for the longest grain it has seen, so the
+    // sources that go through it allocate while warming up
+    int warmupAllocations = 0;
+    int allocations = 0;
+    int grains = 0;
+    // streamed source frames the grains wanted before the prefetcher had them
+    int64_t missedFrames = 0;
+};
+
+// Rack's default audio block size
+const int g_blockSize = 256;
+
+static void processBlock(std::vector<std::unique_ptr<GrainMixer>>& mixers, float& checksum)
+{
+    // a plane per output channel
+    static float buf[PanGainTable::MaxOutputs*g_blockSize];
+    for (auto& mixer : mixers)
+    {
+        std::fill(buf,buf+PanGainTable::MaxOutputs*g_blockSize,0.0f);
+        mixer->processBlock(buf,g_blockSize,g_blockSize);
+        checksum += buf[0];
+    }
+}
+
+// With more than one voice, the voices share the source and each renders the whole
+// block in turn. In real time the blocks are processed when an audio driver would ask
+// for them, otherwise as fast as possible.
+static BenchResult runMixer(GrainAudioSource* src, float sampleRate, float density, float pitch,
+    int numOutputs, float seconds, int numVoices = 1, int grainChans = 1, bool realTime = false)
+{
+    const int numblocks = seconds*sampleRate/g_blockSize;
+    // long enough for the longest grains
+    const int warmupblocks = sampleRate/g_blockSize;
+    std::vector<std::unique_ptr<GrainMixer>> mixers;
+    for (int i=0;i<numVoices;++i)
+    {
+        GrainMixer* mixer = new GrainMixer(src);
+        mixer->m_randgen.seed(i+1);
+        mixer->m_voiceIndex = i;
+        mixer->m_sr = sampleRate;
+        mixer->m_inputdur = src->getSourceNumSamples() > 0 ? src->getSourceNumSamples() : 0;
+        mixer->m_sourceRateRatio = src->getSourceSampleRate()/sampleRate;
+        mixer->m_pitch = pitch;
+        mixer->m_posrandamt = 0.1f;
+        mixer->m_numOutputs = numOutputs;
+        mixer->m_spread = 1.0f;
+        mixer->m_loopstart = (float)i/numVoices;
+        mixer->setDensity(density);
+        mixer->setNumGrainChannels(grainChans);
+        mixers.emplace_back(mixer);
+    }
+    BenchResult result;
+    std::chrono::nanoseconds total{0};
+    std::chrono::nanoseconds worst{0};
+    float checksum = 0.0f;
+    g_allocationCount = 0;
+    g_countAllocations = true;
+    auto blockduration = std::chrono::duration<double>(g_blockSize/sampleRate);
+    auto due = std::chrono::steady_clock::now();
+    auto waitForBlock = [&]()
+    {
+        if (!realTime)
+            return;
+        due += std::chrono::duration_cast<std::chrono::steady_clock::duration>(blockduration);
+        std::this_thread::sleep_until(due);
+    };
+    for (int i=0;i<warmupblocks;++i)
+    {
+        waitForBlock();
+        processBlock(mixers,checksum);
+    }
+    g_countAllocations = false;
+    result.warmupAllocations = g_allocationCount;
+    g_allocationCount = 0;
+    DrWavSource* drwav = dynamic_cast<DrWavSource*>(src);
+    int64_t missedbefore = drwav ? drwav->m_streamMissFrames.load() : 0;
+    for (int i=0;i<numblocks;++i)
+    {
+        waitForBlock();
+        g_countAllocations = true;
+        auto t0 = std::chrono::steady_clock::now();
+        processBlock(mixers,checksum);
+        auto elapsed = std::chrono::steady_clock::now()-t0;
+        g_countAllocations = false;
+        total += elapsed;
+        worst = std::max<std::chrono::nanoseconds>(worst,elapsed);
+    }
+    result.nsPerSample = (double)total.count()/(numblocks*g_blockSize);
+    result.worstBlockMicros = worst.count()/1000.0;
+    result.worstBlockPercent = 100.0*result.worstBlockMicros/(1000000.0*g_blockSize/sampleRate);
+    result.allocations = g_allocationCount;
+    if (drwav)
+        result.missedFrames = drwav->m_streamMissFrames.load()-missedbefore;
+    for (auto& mixer : mixers)
+        result.grains += mixer->debugCounter;
+    // keeps the processing from being optimized away
+    if (checksum == 12345.0f)
+        printf(" ");
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    float seconds = 2.0f;
+    if (argc > 1)
+        seconds = std::max(0.1,std::atof(argv[1]));
+    // a single voice must keep up with real time
+    double budgetPercent = 100.0;
+    if (argc > 2)
+        budgetPercent = std::atof(argv[2]);
+    const float sampleRate = 48000.0f;
+    const drwav_uint64 sourceFrames = 44100*20;
+    std::string wavname = "grainbench_24bit.wav";
+    if (!writeTestWav24(wavname,sourceFrames,2,44100))
+    {
+        printf("could not write %s\n",wavname.c_str());
+        return 2;
+    }
+    struct SourceCase
+    {
+        std::string name;
+        std::unique_ptr<DrWavSource> drwav;
+        std::unique_ptr<GrainAudioSource> rendered;
+        GrainAudioSource* get() { return drwav ? (GrainAudioSource*)drwav.get() : rendered.get(); }
+    };
+    std::vector<SourceCase> cases;
+    auto addDrWav = [&](std::string name, DrWavBuffer* buf)
+    {
+        SourceCase c;
+        c.name = name;
+        c.drwav.reset(new DrWavSource);
+        c.drwav->publishBuffer(std::shared_ptr<DrWavBuffer>(buf),false);
+        cases.push_back(std::move(c));
+    };
+    addDrWav("drwav float 1ch",makeTestBuffer(sourceFrames,1,44100,DrWavBuffer::ST_Float));
+    addDrWav("drwav float 2ch",makeTestBuffer(sourceFrames,2,44100,DrWavBuffer::ST_Float));
+    addDrWav("drwav float 4ch",makeTestBuffer(sourceFrames,4,44100,DrWavBuffer::ST_Float));
+    addDrWav("drwav int16 2ch",makeTestBuffer(sourceFrames,2,44100,DrWavBuffer::ST_Int16));
+    MappedWavFile* mapped = new MappedWavFile;
+    if (!mapped->open(wavname))
+    {
+        printf("could not map %s\n",wavname.c_str());
+        delete mapped;
+        return 2;
+    }
+    addDrWav("drwav mapped24 2ch",new DrWavBuffer(mapped));
+    {
+        SourceCase c;
+        c.name = "rendered 2ch";
+        c.rendered.reset(new RenderedBufferSource(sourceFrames,2,44100.0f));
+        cases.push_back(std::move(c));
+    }
+    const float densities[] = {0.01f,0.05f,0.25f};
+    const float pitches[] = {-12.0f,0.0f,12.0f};
+    const int outputs[] = {1,2,8};
+    // 1, 2 and 4 have their own code paths, 3 takes the generic one
+    const int grainChannels[] = {1,2,3,4};
+    int totalAllocations = 0;
+    int overBudget = 0;
+    auto header = [](const char* extracol)
+    {
+        printf("%-20s %8s %6s %5s %6s %s %11s %10s %7s %7s %7s\n","source","grainrate","pitch","outs",
+            "gchans",extracol,"ns/sample","worst blk%","grains","wualloc","allocs");
+    };
+    auto report = [&](const SourceCase& c, float density, float pitch, int outs, int gchans,
+        const char* extra, const BenchResult& r)
+    {
+        bool late = r.worstBlockPercent > budgetPercent;
+        printf("%-20s %8.2f %6.1f %5d %6d %s %11.1f %9.1f%s %7d %7d %7d\n",c.name.c_str(),density,pitch,outs,
+            gchans,extra,r.nsPerSample,r.worstBlockPercent,late ? "!" : " ",r.grains,r.warmupAllocations,
+            r.allocations);
+        totalAllocations += r.allocations;
+        if (late)
+            ++overBudget;
+    };
+    header("");
+    for (auto& c : cases)
+    {
+        for (float density : densities)
+        {
+            for (float pitch : pitches)
+            {
+                for (int outs : outputs)
+                {
+                    // panned grains only use their first channel
+                    for (int gchans : grainChannels)
+                    {
+                        if (outs > 1 && gchans > 1)
+                            continue;
+                        BenchResult r = runMixer(c.get(),sampleRate,density,pitch,outs,seconds,1,gchans);
+                        report(c,density,pitch,outs,gchans,"",r);
+                    }
+                }
+            }
+        }
+    }
+    // The longest grains at a high sample rate, these need the most grain buffer space
+    printf("\n");
+    header("samplerate");
+    for (auto& c : cases)
+    {
+        for (int gchans : {1,4})
+        {
+            BenchResult r = runMixer(c.get(),192000.0f,0.5f,12.0f,1,seconds,1,gchans);
+            report(c,0.5f,12.0f,1,gchans,"    192000",r);
+        }
+    }
+    // The polyphonic voices only share the source, the grain work is done per voice,
+    // so the cost should grow about linearly with the voice count. The budget is for
+    // one voice, so it isn't checked here.
+    printf("\n%-20s %6s %12s %15s %7s %7s %7s\n","source","voices","ns/sample","ns/sample/voice","grains",
+        "wualloc","allocs");
+    for (auto& c : cases)
+    {
+        for (int voices : {1,4,16})
+        {
+            BenchResult r = runMixer(c.get(),sampleRate,0.05f,0.0f,1,seconds,voices);
+            printf("%-20s %6d %12.1f %15.1f %7d %7d %7d\n",c.name.c_str(),voices,r.nsPerSample,
+                r.nsPerSample/voices,r.grains,r.warmupAllocations,r.allocations);
+            totalAllocations += r.allocations;
+        }
+    }
+    // The prefetcher has the warm up to catch up, after that the streamed file should play
+    // from memory. The other cases run faster than real time, which it can't keep up with.
+    printf("\n%-20s %6s %6s %13s\n","streamed in real time","voices","pitch","missed frames");
+    int64_t totalMissed = 0;
+    for (auto& c : cases)
+    {
+        if (!c.drwav || c.name.find("mapped") == std::string::npos)
+            continue;
+        for (int voices : {1,16})
+        {
+            for (float pitch : {0.0f,12.0f})
+            {
+                BenchResult r = runMixer(c.get(),sampleRate,0.05f,pitch,1,seconds,voices,1,true);
+                printf("%-20s %6d %6.1f %13lld%s\n",c.name.c_str(),voices,pitch,(long long)r.missedFrames,
+                    r.missedFrames > 0 ? "!" : " ");
+                totalMissed += r.missedFrames;
+            }
+        }
+    }
+    cases.clear();
+    std::remove(wavname.c_str());
+    // Pitched up grains go through the resampler's low pass filter. Without it a sine
+    // pitched over the Nyquist frequency comes out at about 0 dB.
+    const double aliasLimitDb = -12.0;
+    int aliasing = 0;
+    printf("\n%10s %6s %10s %8s\n","sine","pitch","pitched to","level dB");
+    for (float pitch : {12.0f,24.0f})
+    {
+        for (float freq : {3000.0f,15000.0f})
+        {
+            float pitchedfreq = freq*std::pow(2.0f,pitch/12.0f);
+            double level = measureGrainLevel(freq,pitch,sampleRate);
+            bool aliased = pitchedfreq > sampleRate*0.5f && level > aliasLimitDb;
+            printf("%10.0f %6.1f %10.0f %8.1f%s\n",freq,pitch,pitchedfreq,level,aliased ? "!" : " ");
+            if (aliased)
+                ++aliasing;
+        }
+    }
+    if (!g_mallocCounted)
+        printf("only allocations made with new were counted\n");
+    int result = 0;
+    if (totalAllocations > 0)
+    {
+        printf("%d allocations during processing after the warm up\n",totalAllocations);
+        result = 1;
+    }
+    if (overBudget > 0)
+    {
+        printf("%d cases had blocks over the budget of %.1f%% (marked with !)\n",overBudget,budgetPercent);
+        result = 1;
+    }
+    if (totalMissed > 0)
+    {
+        printf("%lld streamed frames were not loaded in time and played as silence\n",(long long)totalMissed);
+        result = 1;
+    }
+    if (aliasing > 0)
+    {
+        printf("%d pitched up grains aliased more than %.1f dB (marked with !)\n",aliasing,aliasLimitDb);
+        result = 1;
+    }
+    return result;
+}
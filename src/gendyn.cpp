@@ -6,8 +6,13 @@ GendynModule::GendynModule()
 {
     for (int i=0;i<16;++i)
         m_oscs[i].setRandomSeed(i);
+    for (int i=0;i<4;++i)
+    {
+        m_banks[i].setOscillators(&m_oscs[i*4]);
+        m_smoothedPitch[i] = 0.0f;
+    }
     config(PARAMS::LASTPAR,PARAMS::LASTPAR+1,2);
-    configParam(PAR_NumSegments,3.0,64.0,10.0,"Num segments");
+    configParam(PAR_NumSegments,3.0,NormalMaxNodes,10.0,"Num segments");
     configParam(PAR_TimeDistribution,0.0,LASTDIST-1,1.0,"Time distribution");
     configParam(PAR_TimeMean,-5.0,5.0,0.0,"Time mean");
     configParam(PAR_TimeResetMode,0.0,LASTRM,RM_Avg,"Time reset mode");
@@ -16,11 +21,11 @@ GendynModule::GendynModule()
     configParam(PAR_TimePrimaryBarrierHigh,-5.0,5.0,1.0,"Time primary high barrier");
     configParam(PAR_TimeSecondaryBarrierLow,-60.0,60.0,-1.0,"Time sec low barrier");
     configParam(PAR_TimeSecondaryBarrierHigh,-60.0,60.0,1.0,"Time sec high barrier");
+    configParam(PAR_AmpDistribution,0.0,LASTDIST-1,1.0,"Amp distribution");
     configParam(PAR_AmpResetMode,0.0,LASTRM,RM_UniformRandom,"Amp reset mode");
     configParam(PAR_PolyphonyVoices,1.0,16.0,1,"Polyphony voices");
     configParam(PAR_CenterFrequency,-54.f, 54.f, 0.f, "Center frequency", " Hz", dsp::FREQ_SEMITONE, dsp::FREQ_C4);
     // configParam(FREQ_PARAM, -54.f, 54.f, 0.f, "Frequency", " Hz", dsp::FREQ_SEMITONE, dsp::FREQ_C4);
-    m_divider.setDivision(32);
 }
 
 std::string GendynModule::getDebugMessage()
@@ -35,80 +40,112 @@ std::string GendynModule::getDebugMessage()
 
 void GendynModule::process(const ProcessArgs& args)
 {
-    int numvoices = params[PAR_PolyphonyVoices].getValue();
-    numvoices = clamp(numvoices,1,16);
-    bool shouldReset = false;
     if (m_reset_trigger.process(inputs[0].getVoltage()))
+        m_resetPending = true;
+    if (m_blockPos == BlockSize)
     {
-        shouldReset = true;
-        
-        
+        renderBlock(args.sampleRate);
+        m_blockPos = 0;
     }
-    outputs[0].setChannels(numvoices);
-    outputs[1].setChannels(numvoices);
+    outputs[0].setChannels(m_numVoices);
+    outputs[1].setChannels(m_numVoices);
+    for (int i=0;i<(m_numVoices+3)/4;++i)
+        outputs[0].setVoltageSimd(m_blocks[i][m_blockPos]*5.0f,i*4);
+    ++m_blockPos;
+}
+
+void GendynModule::renderBlock(float sampleRate)
+{
+    int numvoices = params[PAR_PolyphonyVoices].getValue();
+    numvoices = clamp(numvoices,1,16);
+    m_numVoices = numvoices;
+    // the voices are processed in groups of 4, the unused ones of the last group are 
+    // configured too but not output
+    int numbanks = (numvoices+3)/4;
+    bool shouldReset = m_resetPending;
+    m_resetPending = false;
+    int maxnodes = m_extendedNodeRange ? (int)GendynOsc::MaxNodes : (int)NormalMaxNodes;
     float numsegs = params[PAR_NumSegments].getValue();
-    numsegs+=rescale(inputs[1+PAR_NumSegments].getVoltage(),0.0f,10.0f,0,61);
-    numsegs=clamp(numsegs,3.0,64.0);
+    numsegs+=rescale(inputs[1+PAR_NumSegments].getVoltage(),0.0f,10.0f,0,maxnodes-3);
+    numsegs=clamp(numsegs,3.0f,(float)maxnodes);
     float timedev = params[PAR_TimeDeviation].getValue();
     timedev+=rescale(inputs[1+PAR_TimeDeviation].getVoltage(),0.0f,10.0f,0.0f,5.0f);
     timedev=clamp(timedev,0.0f,5.0f);
-    float sectimebarlow = params[PAR_TimeSecondaryBarrierLow].getValue();
-    sectimebarlow+=rescale(inputs[1+PAR_TimeSecondaryBarrierLow].getVoltage(),0.0f,10.0f,1.0,64.0);
-    sectimebarlow=clamp(sectimebarlow,1.0,64.0);
-    float sectimebarhigh = params[PAR_TimeSecondaryBarrierHigh].getValue();
-    sectimebarhigh+=rescale(inputs[1+PAR_TimeSecondaryBarrierHigh].getVoltage(),0.0f,10.0f,1.0,64.0);
-    sectimebarhigh=clamp(sectimebarhigh,1.0,64.0);
-    sanitizeRange(sectimebarlow,sectimebarhigh,1.0f);
-    if (m_divider.process())
+    // pitch and time deviation glide over about 10 milliseconds between the blocks
+    float smoothing = 1.0f-std::exp(-BlockSize/(0.01f*sampleRate));
+    if (m_firstBlock)
     {
-        for (int i=0;i<numvoices;++i)
-        {
-            m_oscs[i].m_sampleRate = args.sampleRate;
-            
-            m_oscs[i].setNumSegments(numsegs);
-            m_oscs[i].m_time_dev = timedev;
-            m_oscs[i].m_time_mean = params[PAR_TimeMean].getValue();
-            float pitch = params[PAR_CenterFrequency].getValue();
-            pitch+=rescale(inputs[1+PAR_CenterFrequency].getVoltage(i),-5.0f,5.0f,-60.0f,60.0f);
-            pitch = clamp(pitch,-60.0f,60.0f);
-            float centerfreq = dsp::FREQ_C4*pow(2.0f,1.0f/12.0f*pitch);
-            m_oscs[i].setFrequencies(centerfreq,params[PAR_TimeSecondaryBarrierLow].getValue(),
-                params[PAR_TimeSecondaryBarrierHigh].getValue());
-            //m_oscs[i].m_time_secondary_low_barrier = sectimebarlow;
-            //m_oscs[i].m_time_secondary_high_barrier = sectimebarhigh;
-            float bar0 = params[PAR_TimePrimaryBarrierLow].getValue();
-            float bar1 = params[PAR_TimePrimaryBarrierHigh].getValue();
-            if (bar1<=bar0)
-                bar1=bar0+0.01;
-            m_oscs[i].m_time_primary_low_barrier = bar0;
-            m_oscs[i].m_time_primary_high_barrier = bar1;
-        }
+        smoothing = 1.0f;
+        m_firstBlock = false;
     }
-    if (shouldReset == true)
+    m_smoothedTimeDev += (timedev-m_smoothedTimeDev)*smoothing;
+    float bar0 = params[PAR_TimePrimaryBarrierLow].getValue();
+    float bar1 = params[PAR_TimePrimaryBarrierHigh].getValue();
+    if (bar1<=bar0)
+        bar1=bar0+0.01;
+    float secbar0 = params[PAR_TimeSecondaryBarrierLow].getValue();
+    float secbar1 = params[PAR_TimeSecondaryBarrierHigh].getValue();
+    bool hq = m_hqMode;
+    for (int i=0;i<numbanks;++i)
     {
-        for (int i=0;i<numvoices;++i)
+        m_banks[i].setHighQuality(hq);
+        simd::float_4 pitch = params[PAR_CenterFrequency].getValue();
+        pitch += inputs[1+PAR_CenterFrequency].getPolyVoltageSimd<simd::float_4>(i*4)*12.0f;
+        pitch = simd::clamp(pitch,-60.0f,60.0f);
+        m_smoothedPitch[i] += (pitch-m_smoothedPitch[i])*smoothing;
+        simd::float_4 centerfreqs = dsp::FREQ_C4*simd::exp(m_smoothedPitch[i]*(std::log(2.0f)/12.0f));
+        m_banks[i].storeState();
+        for (int j=0;j<4;++j)
         {
-            m_oscs[i].m_ampResetMode = params[PAR_AmpResetMode].getValue();
-            m_oscs[i].m_timeResetMode = params[PAR_TimeResetMode].getValue();
-            float pitch = params[PAR_CenterFrequency].getValue();
-            pitch+=rescale(inputs[1+PAR_CenterFrequency].getVoltage(i),-5.0f,5.0f,-60.0f,60.0f);
-            pitch = clamp(pitch,-60.0f,60.0f);
-            float centerfreq = dsp::FREQ_C4*pow(2.0f,1.0f/12.0f*pitch);
-            m_oscs[i].setFrequencies(centerfreq,params[PAR_TimeSecondaryBarrierLow].getValue(),
-                params[PAR_TimeSecondaryBarrierHigh].getValue());
-            m_oscs[i].resetTable();
+            GendynOsc& osc = m_oscs[i*4+j];
+            osc.m_sampleRate = sampleRate;
+            osc.setNumSegments(numsegs);
+            osc.m_time_dev = m_smoothedTimeDev;
+            osc.m_time_mean = params[PAR_TimeMean].getValue();
+            osc.m_timeDistribution = params[PAR_TimeDistribution].getValue();
+            osc.m_ampDistribution = params[PAR_AmpDistribution].getValue();
+            osc.setFrequencies(centerfreqs[j],secbar0,secbar1);
+            osc.m_time_primary_low_barrier = bar0;
+            osc.m_time_primary_high_barrier = bar1;
+            if (shouldReset)
+            {
+                osc.m_ampResetMode = params[PAR_AmpResetMode].getValue();
+                osc.m_timeResetMode = params[PAR_TimeResetMode].getValue();
+                osc.resetTable();
+            }
         }
+        m_banks[i].loadState();
+        m_banks[i].process(m_blocks[i],BlockSize);
     }
     for (int i=0;i<numvoices;++i)
-    {
-        float outsample = 0.0f;
-        m_oscs[i].process(&outsample,1);
-        
         outputs[1].setVoltage(m_oscs[i].m_curFrequencyVolts,i);
-        outputs[0].setVoltage(outsample*5.0f,i);
-    }
-    dsp::SampleRateConverter<8> rs;
-    
+}
+
+json_t* GendynModule::dataToJson()
+{
+    json_t* resultJ = json_object();
+    json_object_set(resultJ,"hqmode",json_boolean(m_hqMode));
+    json_object_set(resultJ,"extendednoderange",json_boolean(m_extendedNodeRange));
+    return resultJ;
+}
+
+void GendynModule::dataFromJson(json_t* root)
+{
+    json_t* hqJ = json_object_get(root,"hqmode");
+    if (hqJ)
+        m_hqMode = json_is_true(hqJ);
+    json_t* rangeJ = json_object_get(root,"extendednoderange");
+    if (rangeJ)
+        setExtendedNodeRange(json_is_true(rangeJ));
+}
+
+void GendynModule::setExtendedNodeRange(bool b)
+{
+    m_extendedNodeRange = b;
+    paramQuantities[PAR_NumSegments]->maxValue = b ? (int)GendynOsc::MaxNodes : (int)NormalMaxNodes;
+    float numsegs = params[PAR_NumSegments].getValue();
+    if (numsegs>paramQuantities[PAR_NumSegments]->maxValue)
+        params[PAR_NumSegments].setValue(paramQuantities[PAR_NumSegments]->maxValue);
 }
 
 GendynWidget::GendynWidget(GendynModule* m)
@@ -166,3 +203,18 @@ void GendynWidget::draw(const DrawArgs &args)
     nvgRestore(args.vg);
     ModuleWidget::draw(args);
 }
+
+void GendynWidget::appendContextMenu(Menu *menu)
+{
+    GendynModule* mod = dynamic_cast<GendynModule*>(module);
+    if (!mod)
+        return;
+    bool hq = mod->m_hqMode;
+    auto hqItem = createMenuItem([mod,hq](){ mod->m_hqMode = !hq; },
+        "High quality (band limited segments)",CHECKMARK(hq));
+    menu->addChild(hqItem);
+    bool extended = mod->m_extendedNodeRange;
+    auto rangeItem = createMenuItem([mod,extended](){ mod->setExtendedNodeRange(!extended); },
+        "Extended segment range (up to "+std::to_string(GendynOsc::MaxNodes)+")",CHECKMARK(extended));
+    menu->addChild(rangeItem);
+}
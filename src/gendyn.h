@@ -24,6 +24,9 @@ enum Distributions
 		DIST_Uniform,
 		DIST_Gauss,
 		DIST_Cauchy,
+		DIST_Logistic,
+		DIST_HypCos,
+		DIST_Arcsine,
 		LASTDIST
 	};
 enum ResetModes
@@ -45,36 +48,131 @@ inline float avg(float a, float b)
 	return a + (b - a) / 2.0f;
 }
 
-class GendynNode
+// Counter based random numbers. Every value is a hash of the seed and the value's position
+// in the stream, so there is no dependency between consecutive values and a whole node 
+// table is filled in one vectorizable loop instead of stepping a generator for each node.
+class GendynRandom
 {
 public:
-	GendynNode() {}
-	float m_x_prim = 0.0f;
-	float m_y_prim = 0.0f;
-	float m_x_sec = 0.0f;
-	float m_y_sec = 0.0f;
+	void setSeed(int s)
+	{
+		m_key = hash((uint32_t)s * 0x9e3779b9u + 0x6a09e667u);
+		m_counter = 0;
+	}
+	// Uniform values in the open interval 0..1
+	void fillUniform(float* dest, int n)
+	{
+		const uint32_t key = m_key;
+		const uint32_t start = m_counter;
+		for (int i = 0; i < n; ++i)
+			dest[i] = ((hash((start + i) * 0x9e3779b9u ^ key) >> 8) + 0.5f) * (1.0f / 16777216.0f);
+		m_counter += n;
+	}
+	// Fills dest with n values of the distribution, shifted by mean and scaled by spread. 
+	// n is rounded up to a multiple of 4, dest must have room for that. The tails are
+	// cut at 16 times the spread, so that the barrier reflections stay cheap.
+	void fill(int dist, float* dest, int n, float mean, float spread)
+	{
+		const int n4 = (n + 3) & ~3;
+		fillUniform(dest, n4);
+		if (dist == DIST_Uniform)
+			transform(dest, n4, mean, spread, [](simd::float_4 z) { return 2.0f * z - 1.0f; });
+		else if (dist == DIST_Cauchy)
+			transform(dest, n4, mean, spread, [](simd::float_4 z) 
+			{ 
+				simd::float_4 x = (float)M_PI * (z - 0.5f);
+				return simd::sin(x) / simd::cos(x); 
+			});
+		else if (dist == DIST_Logistic)
+			transform(dest, n4, mean, spread, [](simd::float_4 z) { return simd::log(z / (1.0f - z)); });
+		else if (dist == DIST_HypCos)
+			transform(dest, n4, mean, spread, [](simd::float_4 z) 
+			{ 
+				simd::float_4 x = (float)M_PI * 0.5f * z;
+				return simd::log(simd::sin(x) / simd::cos(x)); 
+			});
+		else if (dist == DIST_Arcsine)
+			transform(dest, n4, mean, spread, [](simd::float_4 z) { return simd::sin((float)M_PI * (z - 0.5f)); });
+		else
+		{
+			// Box-Muller, with the second set of uniform values in the scratch space
+			float* aux = m_aux;
+			for (int i = 0; i < n4; i += AuxSize)
+			{
+				int chunk = n4 - i < AuxSize ? n4 - i : AuxSize;
+				fillUniform(aux, chunk);
+				for (int j = 0; j < chunk; j += 4)
+				{
+					simd::float_4 u0 = simd::float_4::load(dest + i + j);
+					simd::float_4 u1 = simd::float_4::load(aux + j);
+					simd::float_4 r = simd::sqrt(-2.0f * simd::log(u0)) * simd::cos(2.0f * (float)M_PI * u1);
+					r = simd::clamp(r, -16.0f, 16.0f);
+					(mean + spread * r).store(dest + i + j);
+				}
+			}
+		}
+	}
+private:
+	template<typename F>
+	void transform(float* dest, int n4, float mean, float spread, F f)
+	{
+		for (int i = 0; i < n4; i += 4)
+		{
+			simd::float_4 r = simd::clamp(f(simd::float_4::load(dest + i)), -16.0f, 16.0f);
+			(mean + spread * r).store(dest + i);
+		}
+	}
+	static inline uint32_t hash(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return x;
+	}
+	static const int AuxSize = 64;
+	alignas(16) float m_aux[AuxSize];
+	uint32_t m_key = 0;
+	uint32_t m_counter = 0;
 };
 
+// Reflects the values back into lo..hi as many times as needed, like reflect_value does
+inline simd::float_4 reflect_values(simd::float_4 lo, simd::float_4 x, simd::float_4 hi)
+{
+	simd::float_4 w = simd::fmax(hi - lo, 1.0e-6f);
+	simd::float_4 t = x - lo;
+	t -= 2.0f * w * simd::floor(t / (2.0f * w));
+	return lo + simd::ifelse(t > w, 2.0f * w - t, t);
+}
+
 class GendynOsc
 {
 public:
+	static const int MaxNodes = 1024;
 	GendynOsc()
 	{
-		m_nodes.resize(128);
-		for (int i = 0; i < 128; ++i)
+		m_x_prim.resize(MaxNodes);
+		m_y_prim.resize(MaxNodes);
+		m_x_sec.resize(MaxNodes);
+		m_y_sec.resize(MaxNodes);
+		m_timeSteps.resize(MaxNodes);
+		m_ampSteps.resize(MaxNodes);
+		for (int i = 0; i < MaxNodes; ++i)
 		{
-			m_nodes[i].m_x_prim = avg(m_time_primary_high_barrier, m_time_primary_high_barrier);
-			m_nodes[i].m_x_sec = avg(m_time_secondary_low_barrier, m_time_secondary_high_barrier);
+			m_x_prim[i] = avg(m_time_primary_high_barrier, m_time_primary_high_barrier);
+			m_x_sec[i] = avg(m_time_secondary_low_barrier, m_time_secondary_high_barrier);
 
 		}
-		m_cur_dur = m_nodes.front().m_x_sec;
-		m_cur_y0 = m_nodes.front().m_y_sec;
-		m_cur_y1 = m_nodes[1].m_y_sec;
-		m_next_segment_time = m_nodes[0].m_x_sec;
+		m_cur_dur = m_x_sec[0];
+		m_cur_y0 = m_y_sec[0];
+		m_cur_y1 = m_y_sec[1];
+		m_next_segment_time = m_x_sec[0];
 	}
 	void setRandomSeed(int s)
 	{
 		m_rand = std::mt19937(s);
+		m_random.setSeed(s);
 	}
 	void process(float* buf, int nframes)
 	{
@@ -89,36 +187,7 @@ public:
 			m_phase += 1.0;
 			m_segment_phase += 1.0;
 			if (m_phase >= m_next_segment_time)
-			{
-				++m_cur_node;
-				
-				if (m_cur_node < m_num_segs - 1)
-				{
-					m_cur_dur = m_nodes[m_cur_node].m_x_sec;
-					m_cur_y0 = m_nodes[m_cur_node].m_y_sec;
-					m_cur_y1 = m_nodes[m_cur_node + 1].m_y_sec;
-					m_next_segment_time += m_cur_dur;
-				}
-				if (m_cur_node == m_num_segs - 1)
-				{
-					m_cur_dur = m_nodes[m_cur_node].m_x_sec;
-					m_cur_y0 = m_nodes[m_cur_node].m_y_sec;
-					m_next_segment_time += m_cur_dur;
-					updateTable();
-					m_cur_y1 = m_nodes.front().m_y_sec;
-				}
-				if (m_cur_node == m_num_segs)
-				{
-					
-					m_cur_node = 0;
-					m_cur_dur = m_nodes[m_cur_node].m_x_sec;
-					m_cur_y0 = m_nodes[m_cur_node].m_y_sec;
-					m_cur_y1 = m_nodes[m_cur_node + 1].m_y_sec;
-					m_next_segment_time += m_cur_dur;
-					m_phase = 0.0;
-				}
-				m_segment_phase = 0.0;
-			}
+				advanceSegment();
 		}
 	}
 	void resetTable()
@@ -128,34 +197,34 @@ public:
 		std::uniform_real_distribution<float> unidist(0.0,1.0);
 		for (int i = 0; i < m_num_segs; ++i)
 		{
-			m_nodes[i].m_x_prim = avg(m_time_primary_low_barrier,m_time_primary_high_barrier);
+			m_x_prim[i] = avg(m_time_primary_low_barrier,m_time_primary_high_barrier);
 			if (m_timeResetMode == RM_Avg)
-				m_nodes[i].m_x_sec = avg(m_time_secondary_low_barrier,m_time_secondary_high_barrier);
+				m_x_sec[i] = avg(m_time_secondary_low_barrier,m_time_secondary_high_barrier);
 			else if (m_timeResetMode == RM_BinaryRandom)
 			{
 				if (unidist(m_rand)<0.5)
-					m_nodes[i].m_x_sec = m_time_secondary_low_barrier;
-				else m_nodes[i].m_x_sec = m_time_secondary_high_barrier;
+					m_x_sec[i] = m_time_secondary_low_barrier;
+				else m_x_sec[i] = m_time_secondary_high_barrier;
 			}
 			else
 			{
-				m_nodes[i].m_x_sec = m_sampleRate/m_center_frequency/m_num_segs;
+				m_x_sec[i] = m_sampleRate/m_center_frequency/m_num_segs;
 			}
-			m_nodes[i].m_y_prim = 0.0f;
+			m_y_prim[i] = 0.0f;
 			if (m_ampResetMode == RM_Zeros)
-				m_nodes[i].m_y_sec = 0.0f;
+				m_y_sec[i] = 0.0f;
 			else if (m_ampResetMode == RM_UniformRandom)
-				m_nodes[i].m_y_sec = ampdist(m_rand);
+				m_y_sec[i] = ampdist(m_rand);
 			else
-				m_nodes[i].m_y_sec = 0.0f;
+				m_y_sec[i] = 0.0f;
 		}
 		m_cur_node = 0;
         m_phase = 0.0;
-		m_next_segment_time = m_nodes[0].m_x_sec;
+		m_next_segment_time = m_x_sec[0];
 		m_segment_phase = 0.0;
-		m_cur_dur = m_nodes[m_cur_node].m_x_sec;
-		m_cur_y0 = m_nodes[m_cur_node].m_y_sec;
-		m_cur_y1 = m_nodes[m_cur_node + 1].m_y_sec;
+		m_cur_dur = m_x_sec[m_cur_node];
+		m_cur_y0 = m_y_sec[m_cur_node];
+		m_cur_y1 = m_y_sec[m_cur_node + 1];
 	}
 	void setFrequencies(float center, float a, float b)
 	{
@@ -168,38 +237,45 @@ public:
 		m_time_secondary_low_barrier = clamp(m_sampleRate/hz/m_num_segs,1.0,128.0f);
 		sanitizeRange(m_time_secondary_low_barrier,m_time_secondary_high_barrier,1.0f);
 	}
+	// The random walks of the nodes are independent of each other, so they are done 4 nodes 
+	// at a time. That also walks up to 3 nodes past the used ones, which are only used when 
+	// the number of segments grows.
 	void updateTable()
 	{
-		std::normal_distribution<float> timedist(m_time_mean, m_time_dev);
-		std::normal_distribution<float> ampdist(m_amp_mean, m_amp_dev);
-		float segAcc = 0.0f;
-		for (int i = 0; i < m_num_segs; ++i)
+		m_random.fill(m_timeDistribution, m_timeSteps.data(), m_num_segs, m_time_mean, m_time_dev);
+		m_random.fill(m_ampDistribution, m_ampSteps.data(), m_num_segs, m_amp_mean, m_amp_dev);
+		float secbar0 = m_time_secondary_low_barrier;
+		float secbar1 = m_time_secondary_high_barrier;
+		sanitizeRange(secbar0,secbar1,1.0f);
+		const simd::float_4 primlo = m_time_primary_low_barrier;
+		const simd::float_4 primhi = m_time_primary_high_barrier;
+		const simd::float_4 seclo = secbar0;
+		const simd::float_4 sechi = secbar1;
+		for (int i = 0; i < m_num_segs; i += 4)
 		{
-			float x_p = m_nodes[i].m_x_prim;
-			x_p += timedist(m_rand);
-			x_p = reflect_value(m_time_primary_low_barrier, x_p,m_time_primary_high_barrier);
-			float x_s = m_nodes[i].m_x_sec;
+			simd::float_4 x_p = simd::float_4::load(&m_x_prim[i]);
+			x_p += simd::float_4::load(&m_timeSteps[i]);
+			x_p = reflect_values(primlo, x_p, primhi);
+			simd::float_4 x_s = simd::float_4::load(&m_x_sec[i]);
 			x_s += x_p;
-			float secbar0 = m_time_secondary_low_barrier;
-			float secbar1 = m_time_secondary_high_barrier;
-			sanitizeRange(secbar0,secbar1,1.0f);
-			x_s = reflect_value(secbar0, x_s, secbar1);
-			m_nodes[i].m_x_prim = x_p;
-			m_nodes[i].m_x_sec = x_s;
-			segAcc+=m_nodes[i].m_x_sec;
-			float y_p = m_nodes[i].m_y_prim;
-			y_p += ampdist(m_rand);
-			y_p = clamp(y_p,m_amp_primary_low_barrier, m_amp_primary_high_barrier);
-			float y_s = m_nodes[i].m_y_sec;
+			x_s = reflect_values(seclo, x_s, sechi);
+			x_p.store(&m_x_prim[i]);
+			x_s.store(&m_x_sec[i]);
+			simd::float_4 y_p = simd::float_4::load(&m_y_prim[i]);
+			y_p += simd::float_4::load(&m_ampSteps[i]);
+			y_p = simd::clamp(y_p, m_amp_primary_low_barrier, m_amp_primary_high_barrier);
+			simd::float_4 y_s = simd::float_4::load(&m_y_sec[i]);
 			y_s += y_p;
-			y_s = clamp(y_s,m_amp_secondary_low_barrier, m_amp_secondary_high_barrier);
-			m_nodes[i].m_y_prim = y_p;
-			m_nodes[i].m_y_sec = y_s;
+			y_s = simd::clamp(y_s, m_amp_secondary_low_barrier, m_amp_secondary_high_barrier);
+			y_p.store(&m_y_prim[i]);
+			y_s.store(&m_y_sec[i]);
 		}
+		float segAcc = 0.0f;
+		for (int i = 0; i < m_num_segs; ++i)
+			segAcc += m_x_sec[i];
 		float freq = m_sampleRate/segAcc;
 		float volts = custom_log(freq/rack::dsp::FREQ_C4,2.0f);
         m_curFrequencyVolts = clamp(volts,-5.0,5.0);
-		m_next_segment_time = m_nodes[0].m_x_sec;
 	}
 	int m_num_segs = 11;
 	float m_time_primary_low_barrier = -1.0;
@@ -214,6 +290,8 @@ public:
 	float m_amp_secondary_high_barrier = 0.2;
 	float m_amp_mean = 0.0f;
 	float m_amp_dev = 0.01;
+	int m_timeDistribution = DIST_Gauss;
+	int m_ampDistribution = DIST_Gauss;
 	int m_timeResetMode = RM_Avg;
 	int m_ampResetMode = RM_Zeros;
 	float m_center_frequency = 440.0f;
@@ -224,31 +302,172 @@ public:
     {
         if (n!=m_num_segs)
         {
-            m_num_segs = clamp(n,3,64);
+            m_num_segs = clamp(n,3,MaxNodes);
             //if (m_num_segs>=m_cur_node)
 			{
 				m_cur_node = 0;
             	m_phase = 0.0;
-				m_cur_dur = m_nodes[m_cur_node].m_x_sec;
-				m_cur_y0 = m_nodes[m_cur_node].m_y_sec;
-				m_cur_y1 = m_nodes[m_cur_node + 1].m_y_sec;
+				m_segment_phase = 0.0;
+				m_cur_dur = m_x_sec[m_cur_node];
+				m_next_segment_time = m_cur_dur;
+				m_cur_y0 = m_y_sec[m_cur_node];
+				m_cur_y1 = m_y_sec[m_cur_node + 1];
 			}
         }
     }
 	float m_sampleRate = 44100.0f;
 	
 private:
+	friend class GendynOscBank;
+	// The segments start at their exact fractional times, m_segment_phase is the time from 
+	// the start of the new segment to the current sample.
+	void advanceSegment()
+	{
+		const double breakpoint = m_next_segment_time;
+		++m_cur_node;
+		
+		if (m_cur_node < m_num_segs - 1)
+		{
+			m_cur_dur = m_x_sec[m_cur_node];
+			m_cur_y0 = m_y_sec[m_cur_node];
+			m_cur_y1 = m_y_sec[m_cur_node + 1];
+			m_next_segment_time += m_cur_dur;
+		}
+		if (m_cur_node == m_num_segs - 1)
+		{
+			m_cur_dur = m_x_sec[m_cur_node];
+			m_cur_y0 = m_y_sec[m_cur_node];
+			m_next_segment_time += m_cur_dur;
+			updateTable();
+			m_cur_y1 = m_y_sec[0];
+		}
+		if (m_cur_node == m_num_segs)
+		{
+			
+			m_cur_node = 0;
+			m_cur_dur = m_x_sec[m_cur_node];
+			m_cur_y0 = m_y_sec[m_cur_node];
+			m_cur_y1 = m_y_sec[m_cur_node + 1];
+			m_next_segment_time += m_cur_dur;
+		}
+		m_segment_phase = m_phase - breakpoint;
+		if (m_cur_node == 0)
+		{
+			m_next_segment_time -= m_phase;
+			m_phase = 0.0;
+		}
+	}
 	int m_cur_node = 0;
 	double m_phase = 0.0;
 	double m_segment_phase = 0.0;
 	double m_next_segment_time = 0.0;
-	std::vector<GendynNode> m_nodes;
+	// nodes, with room for rounding the count up to a multiple of 4
+	std::vector<float> m_x_prim;
+	std::vector<float> m_y_prim;
+	std::vector<float> m_x_sec;
+	std::vector<float> m_y_sec;
 	std::mt19937 m_rand;
+	GendynRandom m_random;
+	// random walk steps for the current cycle, with room for rounding up to a multiple of 4
+	std::vector<float> m_timeSteps;
+	std::vector<float> m_ampSteps;
 	float m_cur_dur = 0.0;
 	float m_cur_y0 = 0.0;
 	float m_cur_y1 = 0.0;
 };
 
+// Runs 4 GendynOscs side by side, one per float_4 lane. The segment interpolation is done
+// for all the lanes at once and only the lanes that cross a breakpoint fall back to the
+// oscillator's own scalar code. The bank keeps its own copy of the segment state, so
+// storeState has to be called before the oscillators are modified from outside and
+// loadState after that.
+// In high quality mode the corners at the breakpoints are band limited with 2 point 
+// polyBLAMP corrections, which removes most of the aliasing of the linear segments.
+class GendynOscBank
+{
+public:
+	void setHighQuality(bool b)
+	{
+		if (!b)
+			m_correction = 0.0f;
+		m_highQuality = b;
+	}
+	void setOscillators(GendynOsc* oscs)
+	{
+		for (int i = 0; i < 4; ++i)
+			m_oscs[i] = &oscs[i];
+		loadState();
+	}
+	void loadState()
+	{
+		for (int i = 0; i < 4; ++i)
+			loadLane(i);
+	}
+	void storeState()
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			m_oscs[i]->m_phase = m_phase[i];
+			m_oscs[i]->m_segment_phase = m_segment_phase[i];
+		}
+	}
+	simd::float_4 process()
+	{
+		simd::float_4 out = m_y0 + m_slope * m_segment_phase + m_correction;
+		m_correction = 0.0f;
+		m_phase += 1.0f;
+		m_segment_phase += 1.0f;
+		int crossed = simd::movemask(m_phase >= m_next_segment_time);
+		if (crossed)
+		{
+			for (int i = 0; i < 4; ++i)
+			{
+				if (crossed & (1 << i))
+				{
+					const float oldslope = m_slope[i];
+					m_oscs[i]->m_phase = m_phase[i];
+					m_oscs[i]->advanceSegment();
+					loadLane(i);
+					if (m_highQuality)
+					{
+						// the breakpoint is d samples before the next output sample
+						const float d = m_segment_phase[i];
+						const float e = 1.0f - d;
+						const float delta = (m_slope[i] - oldslope) * (1.0f / 6.0f);
+						out[i] += delta * d * d * d;
+						m_correction[i] = delta * e * e * e;
+					}
+				}
+			}
+		}
+		return out;
+	}
+	void process(simd::float_4* buf, int nframes)
+	{
+		for (int i = 0; i < nframes; ++i)
+			buf[i] = process();
+	}
+private:
+	void loadLane(int i)
+	{
+		GendynOsc& osc = *m_oscs[i];
+		m_phase[i] = osc.m_phase;
+		m_segment_phase[i] = osc.m_segment_phase;
+		m_next_segment_time[i] = osc.m_next_segment_time;
+		m_y0[i] = osc.m_cur_y0;
+		m_slope[i] = (osc.m_cur_y1 - osc.m_cur_y0) / osc.m_cur_dur;
+	}
+	GendynOsc* m_oscs[4] = {};
+	simd::float_4 m_phase = 0.0f;
+	simd::float_4 m_segment_phase = 0.0f;
+	simd::float_4 m_next_segment_time = 0.0f;
+	simd::float_4 m_y0 = 0.0f;
+	simd::float_4 m_slope = 0.0f;
+	// polyBLAMP correction still to be added to the next output sample
+	simd::float_4 m_correction = 0.0f;
+	bool m_highQuality = false;
+};
+
 class GendynModule : public rack::Module
 {
 public:
@@ -279,10 +498,28 @@ public:
     GendynModule();
     std::string getDebugMessage();
     void process(const ProcessArgs& args) override;
+	json_t* dataToJson() override;
+	void dataFromJson(json_t* root) override;
+	// band limited segments
+	std::atomic<bool> m_hqMode{false};
+	// lets the segments knob and CV go up to GendynOsc::MaxNodes instead of 64
+	std::atomic<bool> m_extendedNodeRange{false};
+	void setExtendedNodeRange(bool b);
 private:
+	// Output is rendered in blocks, with the parameters updated once per block
+	static const int BlockSize = 32;
+	static const int NormalMaxNodes = 64;
+	void renderBlock(float sampleRate);
     GendynOsc m_oscs[16];
+	GendynOscBank m_banks[4];
+	simd::float_4 m_blocks[4][BlockSize];
+	int m_blockPos = BlockSize;
+	int m_numVoices = 1;
+	bool m_resetPending = false;
+	bool m_firstBlock = true;
+	simd::float_4 m_smoothedPitch[4];
+	float m_smoothedTimeDev = 0.0f;
 	dsp::SchmittTrigger m_reset_trigger;
-	dsp::ClockDivider m_divider;
 };
 
 class GendynWidget : public ModuleWidget
@@ -290,4 +527,5 @@ class GendynWidget : public ModuleWidget
 public:
     GendynWidget(GendynModule* m);
     void draw(const DrawArgs &args) override;
+	void appendContextMenu(Menu *menu) override;
 };
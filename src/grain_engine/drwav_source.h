@@ -0,0 +1,1343 @@
+#pragma once
+
+#include "../plugin.hpp"
+#include "grain_engine.h"
+#include "dr_wav.h"
+#include "mapped_wav.h"
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <set>
+#include <tuple>
+#include <sys/stat.h>
+
+// The dr_wav implementation is compiled in granularmodule.cpp
+
+// Sample data plus its format. Never modified after it has been handed
+// to the audio thread, edits always produce a new buffer.
+class DrWavBuffer
+{
+public:
+    enum Storage
+    {
+        ST_Float,
+        // half the memory of floats, lossless for 16 bit files
+        ST_Int16,
+        ST_Mapped
+    };
+    DrWavBuffer() {}
+    // takes ownership of memory allocated by dr_wav
+    DrWavBuffer(float* src, drwav_uint64 numFrames, unsigned int channels, unsigned int sampleRate)
+    {
+        m_buf = src;
+        m_sz = numFrames;
+        m_channels = channels;
+        m_sampleRate = sampleRate;
+        m_fromDrWav = true;
+    }
+    DrWavBuffer(drwav_uint64 numFrames, unsigned int channels, unsigned int sampleRate, 
+        Storage storage = ST_Float)
+    {
+        if (storage == ST_Int16)
+            m_buf16 = new int16_t[numFrames*channels];
+        else
+            m_buf = new float[numFrames*channels];
+        m_sz = numFrames;
+        m_channels = channels;
+        m_sampleRate = sampleRate;
+    }
+    // streams from a memory mapped file, takes ownership
+    DrWavBuffer(MappedWavFile* mapped)
+    {
+        m_mapped.reset(mapped);
+        m_sz = mapped->size();
+        m_channels = mapped->channels();
+        m_sampleRate = mapped->sampleRate();
+    }
+    ~DrWavBuffer()
+    {
+        release();
+    }
+    DrWavBuffer(const DrWavBuffer&) = delete;
+    DrWavBuffer& operator=(const DrWavBuffer&) = delete;
+    DrWavBuffer(DrWavBuffer&& other)
+    {
+        *this = std::move(other);
+    }
+    DrWavBuffer& operator=(DrWavBuffer&& other)
+    {
+        std::swap(m_buf,other.m_buf);
+        std::swap(m_buf16,other.m_buf16);
+        std::swap(m_sz,other.m_sz);
+        std::swap(m_channels,other.m_channels);
+        std::swap(m_sampleRate,other.m_sampleRate);
+        std::swap(m_fromDrWav,other.m_fromDrWav);
+        std::swap(m_mapped,other.m_mapped);
+        return *this;
+    }
+    DrWavBuffer* clone() const
+    {
+        DrWavBuffer* result = new DrWavBuffer(m_sz,m_channels,m_sampleRate);
+        if (m_buf)
+            std::copy(m_buf,m_buf+m_sz*m_channels,result->m_buf);
+        else
+        {
+            for (drwav_uint64 i=0;i<m_sz;++i)
+                for (unsigned int j=0;j<m_channels;++j)
+                    result->m_buf[i*m_channels+j] = getSample(i,j);
+        }
+        return result;
+    }
+    DrWavBuffer* cloneAsInt16() const
+    {
+        DrWavBuffer* result = new DrWavBuffer(m_sz,m_channels,m_sampleRate,ST_Int16);
+        for (drwav_uint64 i=0;i<m_sz;++i)
+            for (unsigned int j=0;j<m_channels;++j)
+                result->m_buf16[i*m_channels+j] = floatToInt16(getSample(i,j));
+        return result;
+    }
+    // writable float data, only for buffers that are not yet published
+    float* data() { return m_buf; }
+    // writable 16 bit data, same as above
+    int16_t* data16() { return m_buf16; }
+    // Writes float frames in whatever format the buffer stores, only for buffers that are not yet published
+    void writeFrames(drwav_uint64 startFrame, const float* src, drwav_uint64 numFrames)
+    {
+        drwav_uint64 numsamples = numFrames*m_channels;
+        if (m_buf)
+            std::copy(src,src+numsamples,m_buf+startFrame*m_channels);
+        else if (m_buf16)
+        {
+            int16_t* dest = m_buf16+startFrame*m_channels;
+            for (drwav_uint64 i=0;i<numsamples;++i)
+                dest[i] = floatToInt16(src[i]);
+        }
+    }
+    void silenceFrom(drwav_uint64 startFrame)
+    {
+        if (m_buf)
+            std::fill(m_buf+startFrame*m_channels,m_buf+m_sz*m_channels,0.0f);
+        else if (m_buf16)
+            std::fill(m_buf16+startFrame*m_channels,m_buf16+m_sz*m_channels,0);
+    }
+    static inline int16_t floatToInt16(float x)
+    {
+        return std::max(-32768.0f,std::min(32767.0f,std::round(x*32768.0f)));
+    }
+    // contiguous interleaved float samples if available, nullptr otherwise
+    const float* floatData() const 
+    { 
+        if (m_mapped)
+            return m_mapped->floatData();
+        return m_buf; 
+    }
+    // contiguous interleaved 16 bit samples if available, nullptr otherwise
+    const int16_t* int16Data() const
+    {
+        if (m_mapped)
+            return m_mapped->int16Data();
+        return m_buf16;
+    }
+    inline float getSample(drwav_uint64 frame, int chan) const
+    {
+        if (m_buf)
+            return m_buf[frame*m_channels+chan];
+        if (m_buf16)
+            return m_buf16[frame*m_channels+chan]*(1.0f/32768.0f);
+        return m_mapped->getSample(frame,chan);
+    }
+    Storage storage() const
+    {
+        if (m_mapped)
+            return ST_Mapped;
+        if (m_buf16)
+            return ST_Int16;
+        return ST_Float;
+    }
+    MappedWavFile* mappedFile() const { return m_mapped.get(); }
+    drwav_uint64 size() const { return m_sz; }
+    unsigned int channels() const { return m_channels; }
+    unsigned int sampleRate() const { return m_sampleRate; }
+private:
+    void release()
+    {
+        if (m_buf && m_fromDrWav)
+            drwav_free(m_buf, nullptr);
+        else
+            delete[] m_buf;
+        delete[] m_buf16;
+        m_buf = nullptr;
+        m_buf16 = nullptr;
+    }
+    float* m_buf = nullptr;
+    int16_t* m_buf16 = nullptr;
+    drwav_uint64 m_sz = 0;
+    unsigned int m_channels = 0;
+    unsigned int m_sampleRate = 0;
+    bool m_fromDrWav = false;
+    std::unique_ptr<MappedWavFile> m_mapped;
+};
+
+// Plugin wide pool of loaded sample buffers, keyed by canonical path, modification
+// time, sample rate and storage format. Several modules using the same 
+// file share one read only buffer. The pool only holds weak references, a buffer 
+// goes away when the last module using it lets go of it.
+class SamplePool
+{
+public:
+    static SamplePool& instance()
+    {
+        static SamplePool pool;
+        return pool;
+    }
+    // Returns the pooled buffer or calls loadFunc to create it. If another thread is
+    // already loading the same buffer, waits for it instead of loading it twice.
+    // Not to be called from the audio thread.
+    std::shared_ptr<DrWavBuffer> acquire(std::string filename, unsigned int sampleRate, 
+        DrWavBuffer::Storage storage, std::function<DrWavBuffer*(void)> loadFunc, std::atomic<bool>& cancel)
+    {
+        Key key;
+        if (!makeKey(filename,sampleRate,storage,key))
+            return std::shared_ptr<DrWavBuffer>(loadFunc());
+        std::unique_lock<std::mutex> locker(m_mut);
+        while (m_loading.count(key))
+        {
+            if (cancel)
+                return nullptr;
+            m_cv.wait_for(locker,std::chrono::milliseconds(50));
+        }
+        auto it = m_entries.find(key);
+        if (it != m_entries.end())
+        {
+            std::shared_ptr<DrWavBuffer> result = it->second.lock();
+            if (result)
+                return result;
+            m_entries.erase(it);
+        }
+        m_loading.insert(key);
+        locker.unlock();
+        std::shared_ptr<DrWavBuffer> result(loadFunc());
+        locker.lock();
+        m_loading.erase(key);
+        if (result)
+            m_entries[key] = result;
+        m_cv.notify_all();
+        return result;
+    }
+    // Adds a buffer made outside of acquire, like a sample rate converted one
+    void add(std::string filename, unsigned int sampleRate, DrWavBuffer::Storage storage, 
+        std::shared_ptr<DrWavBuffer> buf)
+    {
+        Key key;
+        if (!makeKey(filename,sampleRate,storage,key))
+            return;
+        std::lock_guard<std::mutex> locker(m_mut);
+        m_entries[key] = buf;
+    }
+    std::shared_ptr<DrWavBuffer> find(std::string filename, unsigned int sampleRate, DrWavBuffer::Storage storage)
+    {
+        Key key;
+        if (!makeKey(filename,sampleRate,storage,key))
+            return nullptr;
+        std::lock_guard<std::mutex> locker(m_mut);
+        auto it = m_entries.find(key);
+        if (it != m_entries.end())
+            return it->second.lock();
+        return nullptr;
+    }
+private:
+    // canonical path, modification time, sample rate (0 for the file's own rate), storage
+    typedef std::tuple<std::string,int64_t,unsigned int,int> Key;
+    static bool makeKey(std::string filename, unsigned int sampleRate, DrWavBuffer::Storage storage, Key& key)
+    {
+#ifdef _WIN32
+        int wlen = MultiByteToWideChar(CP_UTF8,0,filename.c_str(),-1,nullptr,0);
+        if (wlen == 0)
+            return false;
+        std::wstring wfilename(wlen,0);
+        MultiByteToWideChar(CP_UTF8,0,filename.c_str(),-1,&wfilename[0],wlen);
+        wchar_t fullpath[MAX_PATH];
+        if (_wfullpath(fullpath,wfilename.c_str(),MAX_PATH) == nullptr)
+            return false;
+        struct _stat64 st;
+        if (_wstat64(fullpath,&st) != 0)
+            return false;
+        char utf8path[MAX_PATH*4];
+        if (WideCharToMultiByte(CP_UTF8,0,fullpath,-1,utf8path,sizeof(utf8path),nullptr,nullptr) == 0)
+            return false;
+        std::string canonical(utf8path);
+        std::transform(canonical.begin(),canonical.end(),canonical.begin(),::tolower);
+#else
+        char* resolved = realpath(filename.c_str(),nullptr);
+        if (resolved == nullptr)
+            return false;
+        std::string canonical(resolved);
+        std::free(resolved);
+        struct stat st;
+        if (stat(canonical.c_str(),&st) != 0)
+            return false;
+#endif
+        key = Key(canonical,(int64_t)st.st_mtime,sampleRate,storage);
+        return true;
+    }
+    std::mutex m_mut;
+    std::condition_variable m_cv;
+    std::map<Key,std::weak_ptr<DrWavBuffer>> m_entries;
+    std::set<Key> m_loading;
+};
+
+// Runs one file load at a time, so that a patch with many sample modules doesn't 
+// decode all of its files at once. Of the waiting loads, decoding for modules that 
+// are on screen goes first, then decoding in the order the loads were requested 
+// and last the sample rate conversions, which can happen in the background.
+class LoadScheduler
+{
+public:
+    enum Stage
+    {
+        LS_Decode,
+        LS_Convert
+    };
+    static LoadScheduler& instance()
+    {
+        static LoadScheduler scheduler;
+        return scheduler;
+    }
+    uint64_t nextOrder()
+    {
+        return m_nextOrder++;
+    }
+    // Blocks until it's the caller's turn. Returns false if cancel was set while waiting, 
+    // otherwise release must be called when the load is done.
+    bool acquire(Stage stage, uint64_t order, std::function<bool(void)> isVisible, std::atomic<bool>& cancel)
+    {
+        Waiter waiter{stage,order,isVisible};
+        std::unique_lock<std::mutex> locker(m_mut);
+        m_waiters.push_back(&waiter);
+        while (true)
+        {
+            if (cancel || (!m_busy && bestWaiter() == &waiter))
+            {
+                m_waiters.erase(std::find(m_waiters.begin(),m_waiters.end(),&waiter));
+                if (cancel)
+                {
+                    m_cv.notify_all();
+                    return false;
+                }
+                m_busy = true;
+                return true;
+            }
+            // visibility can change while waiting, so check again now and then
+            m_cv.wait_for(locker,std::chrono::milliseconds(50));
+        }
+    }
+    void release()
+    {
+        std::lock_guard<std::mutex> locker(m_mut);
+        m_busy = false;
+        m_cv.notify_all();
+    }
+private:
+    struct Waiter
+    {
+        Stage stage;
+        uint64_t order;
+        std::function<bool(void)> isVisible;
+    };
+    Waiter* bestWaiter()
+    {
+        Waiter* best = nullptr;
+        int bestRank = 0;
+        for (Waiter* w : m_waiters)
+        {
+            int rank = w->stage == LS_Convert ? 2 : (w->isVisible() ? 0 : 1);
+            if (!best || rank < bestRank || (rank == bestRank && w->order < best->order))
+            {
+                best = w;
+                bestRank = rank;
+            }
+        }
+        return best;
+    }
+    std::mutex m_mut;
+    std::condition_variable m_cv;
+    std::vector<Waiter*> m_waiters;
+    bool m_busy = false;
+    std::atomic<uint64_t> m_nextOrder{0};
+};
+
+struct SamplePeaks
+{
+    float minpeak = 0.0f;
+    float maxpeak = 0.0f;
+};
+
+// Min/max waveform peaks at 64, 512, 4096... samples per peak, so drawing can pick a
+// level close to the pixel width of the display. Levels are added until the coarsest
+// has at most MaxCoarsestPeaks peaks, so for displays at least that wide the picked
+// level has fewer than LevelFactor peaks per pixel, however long the file.
+class PeakPyramid
+{
+public:
+    static const int BaseSamplesPerPeak = 64;
+    static const int LevelFactor = 8;
+    static const int MaxCoarsestPeaks = 64;
+    int numChannels = 0;
+    // [level][channel][peak]
+    std::vector<std::vector<std::vector<SamplePeaks>>> levels;
+    int getNumLevels() const { return levels.size(); }
+    int getNumPeaks(int level) const
+    {
+        if (numChannels == 0)
+            return 0;
+        return levels[level][0].size();
+    }
+    // The coarsest level that still has at least one peak per pixel
+    int getLevelForWidth(int pixels) const
+    {
+        for (int i=getNumLevels()-1;i>0;--i)
+        {
+            if (getNumPeaks(i)>=pixels)
+                return i;
+        }
+        return 0;
+    }
+    void build(const DrWavBuffer& buf)
+    {
+        numChannels = buf.channels();
+        drwav_uint64 numframes = buf.size();
+        int numpeaks = (numframes+BaseSamplesPerPeak-1)/BaseSamplesPerPeak;
+        levels.clear();
+        while (true)
+        {
+            levels.emplace_back(numChannels,std::vector<SamplePeaks>(numpeaks));
+            if (numpeaks <= MaxCoarsestPeaks)
+                break;
+            numpeaks = (numpeaks+LevelFactor-1)/LevelFactor;
+        }
+        const float* data = buf.floatData();
+        const bool usesimd = data && (numChannels == 1 || numChannels == 2 || numChannels == 4);
+        auto& level0 = levels[0];
+        float minpeaks[4];
+        float maxpeaks[4];
+        for (int i=0;i<(int)level0[0].size();++i)
+        {
+            drwav_uint64 frame0 = (drwav_uint64)i*BaseSamplesPerPeak;
+            drwav_uint64 frame1 = std::min<drwav_uint64>(frame0+BaseSamplesPerPeak,numframes);
+            if (usesimd && frame1-frame0 == BaseSamplesPerPeak)
+            {
+                // with 1, 2 or 4 channels a lane always holds the same channel
+                simdMinMax(data+frame0*numChannels,BaseSamplesPerPeak*numChannels,minpeaks,maxpeaks);
+                for (int j=0;j<numChannels;++j)
+                {
+                    float minsample = minpeaks[j];
+                    float maxsample = maxpeaks[j];
+                    for (int k=j+numChannels;k<4;k+=numChannels)
+                    {
+                        minsample = std::min(minsample,minpeaks[k]);
+                        maxsample = std::max(maxsample,maxpeaks[k]);
+                    }
+                    level0[j][i].minpeak = minsample;
+                    level0[j][i].maxpeak = maxsample;
+                }
+                continue;
+            }
+            for (int j=0;j<numChannels;++j)
+            {
+                float minsample = std::numeric_limits<float>::max();
+                float maxsample = -std::numeric_limits<float>::max();
+                for (drwav_uint64 k=frame0;k<frame1;++k)
+                {
+                    float sample = buf.getSample(k,j);
+                    minsample = std::min(minsample,sample);
+                    maxsample = std::max(maxsample,sample);
+                }
+                level0[j][i].minpeak = minsample;
+                level0[j][i].maxpeak = maxsample;
+            }
+        }
+        for (int i=1;i<getNumLevels();++i)
+        {
+            for (int j=0;j<numChannels;++j)
+            {
+                auto& src = levels[i-1][j];
+                auto& dest = levels[i][j];
+                for (int k=0;k<(int)dest.size();++k)
+                {
+                    int index0 = k*LevelFactor;
+                    int index1 = std::min<int>(index0+LevelFactor,src.size());
+                    SamplePeaks result = src[index0];
+                    for (int l=index0+1;l<index1;++l)
+                    {
+                        result.minpeak = std::min(result.minpeak,src[l].minpeak);
+                        result.maxpeak = std::max(result.maxpeak,src[l].maxpeak);
+                    }
+                    dest[k] = result;
+                }
+            }
+        }
+    }
+private:
+    static void simdMinMax(const float* data, int numsamples, float* minpeaks, float* maxpeaks)
+    {
+        simd::float_4 vmin(std::numeric_limits<float>::max());
+        simd::float_4 vmax(-std::numeric_limits<float>::max());
+        for (int i=0;i<numsamples;i+=4)
+        {
+            simd::float_4 v = simd::float_4::load(data+i);
+            vmin = simd::fmin(vmin,v);
+            vmax = simd::fmax(vmax,v);
+        }
+        vmin.store(minpeaks);
+        vmax.store(maxpeaks);
+    }
+};
+
+class DrWavSource : public GrainAudioSource
+{
+public:
+    // Mirrors of the current buffer's format, safe to read from any thread
+    std::atomic<unsigned int> m_channels{0};
+    std::atomic<unsigned int> m_sampleRate{0};
+    std::atomic<drwav_uint64> m_totalPCMFrameCount{0};
+    // Offline edits. Each one makes a new buffer from the source, so the source can keep 
+    // playing while the edit runs.
+    static DrWavBuffer* normalize(const DrWavBuffer& src, float level)
+    {
+        const float* data = src.floatData();
+        size_t numsamples = src.size()*src.channels();
+        simd::float_4 vpeak(0.0f);
+        size_t i = 0;
+        for (;i+4<=numsamples;i+=4)
+            vpeak = simd::fmax(vpeak,simd::fabs(simd::float_4::load(data+i)));
+        float peak = std::max(std::max(vpeak[0],vpeak[1]),std::max(vpeak[2],vpeak[3]));
+        for (;i<numsamples;++i)
+            peak = std::max(peak,std::fabs(data[i]));
+        float normfactor = 1.0f;
+        if (peak>0.0f)
+            normfactor = level/peak;
+        return applyGain(src,normfactor);
+    }
+    static DrWavBuffer* reverse(const DrWavBuffer& src)
+    {
+        DrWavBuffer* result = new DrWavBuffer(src.size(),src.channels(),src.sampleRate());
+        const float* data = src.floatData();
+        float* dest = result->data();
+        size_t numframes = src.size();
+        size_t numchans = src.channels();
+        size_t i = 0;
+        // whole vectors of frames for the common channel counts, 
+        // lanes reordered so the frames come out backwards
+        if (numchans == 1)
+        {
+            for (;i+4<=numframes;i+=4)
+            {
+                simd::float_4 v = simd::float_4::load(data+numframes-i-4);
+                simd::float_4(_mm_shuffle_ps(v.v,v.v,_MM_SHUFFLE(0,1,2,3))).store(dest+i);
+            }
+        } else if (numchans == 2)
+        {
+            for (;i+2<=numframes;i+=2)
+            {
+                simd::float_4 v = simd::float_4::load(data+(numframes-i-2)*2);
+                simd::float_4(_mm_shuffle_ps(v.v,v.v,_MM_SHUFFLE(1,0,3,2))).store(dest+i*2);
+            }
+        } else if (numchans == 4)
+        {
+            for (;i<numframes;++i)
+                simd::float_4::load(data+(numframes-i-1)*4).store(dest+i*4);
+        }
+        for (;i<numframes;++i)
+        {
+            size_t index = numframes-i-1;
+            for (size_t j=0;j<numchans;++j)
+                dest[i*numchans+j] = data[index*numchans+j];
+        }
+        return result;
+    }
+    static DrWavBuffer* removeDC(const DrWavBuffer& src)
+    {
+        DrWavBuffer* result = new DrWavBuffer(src.size(),src.channels(),src.sampleRate());
+        const float* data = src.floatData();
+        float* dest = result->data();
+        size_t numframes = src.size();
+        size_t numchans = src.channels();
+        std::vector<double> sums(numchans,0.0);
+        for (size_t i=0;i<numframes;++i)
+            for (size_t j=0;j<numchans;++j)
+                sums[j] += data[i*numchans+j];
+        std::vector<float> offsets(numchans);
+        for (size_t j=0;j<numchans;++j)
+            offsets[j] = sums[j]/numframes;
+        for (size_t i=0;i<numframes;++i)
+            for (size_t j=0;j<numchans;++j)
+                dest[i*numchans+j] = data[i*numchans+j]-offsets[j];
+        return result;
+    }
+    // Linear fades at both ends, at most half of the buffer each
+    static DrWavBuffer* fadeInOut(const DrWavBuffer& src, float seconds)
+    {
+        DrWavBuffer* result = src.clone();
+        float* dest = result->data();
+        size_t numframes = src.size();
+        size_t numchans = src.channels();
+        size_t fadelen = std::min<size_t>(seconds*src.sampleRate(),numframes/2);
+        for (size_t i=0;i<fadelen;++i)
+        {
+            float gain = (float)i/fadelen;
+            for (size_t j=0;j<numchans;++j)
+            {
+                dest[i*numchans+j] *= gain;
+                dest[(numframes-i-1)*numchans+j] *= gain;
+            }
+        }
+        return result;
+    }
+    // Keeps only the part of the buffer between the normalized loop start and length
+    static DrWavBuffer* trim(const DrWavBuffer& src, float loopstart, float looplen)
+    {
+        size_t numframes = src.size();
+        size_t numchans = src.channels();
+        size_t startframe = std::min<size_t>(clamp(loopstart,0.0f,1.0f)*numframes,numframes-1);
+        size_t lenframes = clamp(looplen,0.0f,1.0f)*numframes;
+        lenframes = std::max<size_t>(1,std::min(lenframes,numframes-startframe));
+        DrWavBuffer* result = new DrWavBuffer(lenframes,numchans,src.sampleRate());
+        const float* data = src.floatData()+startframe*numchans;
+        std::copy(data,data+lenframes*numchans,result->data());
+        return result;
+    }
+    static DrWavBuffer* applyGain(const DrWavBuffer& src, float gain)
+    {
+        DrWavBuffer* result = new DrWavBuffer(src.size(),src.channels(),src.sampleRate());
+        const float* data = src.floatData();
+        float* dest = result->data();
+        size_t numsamples = src.size()*src.channels();
+        simd::float_4 vgain(gain);
+        size_t i = 0;
+        for (;i+4<=numsamples;i+=4)
+            (simd::float_4::load(data+i)*vgain).store(dest+i);
+        for (;i<numsamples;++i)
+            dest[i] = data[i]*gain;
+        return result;
+    }
+    typedef std::function<DrWavBuffer*(const DrWavBuffer&)> BufferEditFunc;
+    typedef std::function<void()> EditDoneFunc;
+    // Queues an edit of the current buffer. The edits run in order on a worker thread and
+    // each result replaces the current buffer once it's ready. onDone is called on the worker
+    // thread after the result has replaced the buffer, not at all if the edit failed.
+    // Call from the GUI thread.
+    void editBufferAsync(BufferEditFunc func, EditDoneFunc onDone = nullptr)
+    {
+        clearError();
+        std::lock_guard<std::mutex> locker(m_editMut);
+        m_editQueue.push_back(std::make_pair(func,onDone));
+        if (!m_editing)
+        {
+            if (m_editThread.joinable())
+                m_editThread.join();
+            m_editing = true;
+            m_editThread = std::thread([this]() { editTask(); });
+        }
+    }
+    bool isEditing() { return m_editing; }
+    void updatePeaks(const DrWavBuffer& buf)
+    {
+        PeakPyramid peaks;
+        peaks.build(buf);
+        std::lock_guard<std::mutex> locker(m_peaksMut);
+        m_peaks = std::move(peaks);
+    }
+    // Decodes in chunks so that progress can be reported and the decoding cancelled
+    static DrWavBuffer* decodeFile(std::string filename, std::atomic<float>& progress, 
+        std::atomic<bool>& cancel, DrWavBuffer::Storage storage = DrWavBuffer::ST_Float)
+    {
+        drwav wav;
+        if (!drwav_init_file(&wav, filename.c_str(), nullptr))
+            return nullptr;
+        if (wav.channels == 0 || wav.totalPCMFrameCount == 0)
+        {
+            drwav_uninit(&wav);
+            return nullptr;
+        }
+        DrWavBuffer* buf = new DrWavBuffer(wav.totalPCMFrameCount,wav.channels,wav.sampleRate,storage);
+        const drwav_uint64 chunklen = 65536;
+        drwav_uint64 framesread = 0;
+        while (framesread < wav.totalPCMFrameCount)
+        {
+            if (cancel)
+            {
+                drwav_uninit(&wav);
+                delete buf;
+                return nullptr;
+            }
+            drwav_uint64 wanted = std::min(chunklen,wav.totalPCMFrameCount-framesread);
+            drwav_uint64 got = 0;
+            if (storage == DrWavBuffer::ST_Int16)
+                got = drwav_read_pcm_frames_s16(&wav,wanted,buf->data16()+framesread*wav.channels);
+            else
+                got = drwav_read_pcm_frames_f32(&wav,wanted,buf->data()+framesread*wav.channels);
+            if (got == 0)
+                break;
+            framesread += got;
+            progress = (double)framesread/wav.totalPCMFrameCount;
+        }
+        // truncated file, silence the part that could not be read
+        buf->silenceFrom(framesread);
+        drwav_uninit(&wav);
+        return buf;
+    }
+    // Offline sinc resampling to the engine rate, so the grains don't have to 
+    // compensate for the file's sample rate. The result is stored in the same format as the source.
+    static DrWavBuffer* convertSampleRate(const DrWavBuffer& src, unsigned int outrate, 
+        std::atomic<float>& progress, std::atomic<bool>& cancel)
+    {
+        unsigned int chans = src.channels();
+        drwav_uint64 inframes = src.size();
+        drwav_uint64 outframes = (double)inframes*outrate/src.sampleRate();
+        if (chans == 0 || chans > WDL_RESAMPLE_MAX_NCH || outframes == 0)
+            return nullptr;
+        DrWavBuffer* result = new DrWavBuffer(outframes,chans,outrate,
+            src.storage() == DrWavBuffer::ST_Int16 ? DrWavBuffer::ST_Int16 : DrWavBuffer::ST_Float);
+        const drwav_uint64 chunklen = 4096;
+        std::vector<float> outchunk(chunklen*chans);
+        WDL_Resampler rs;
+        rs.SetMode(true,0,true,64,32);
+        rs.SetRates(src.sampleRate(),outrate);
+        drwav_uint64 inpos = 0;
+        drwav_uint64 outpos = 0;
+        while (outpos < outframes)
+        {
+            if (cancel)
+            {
+                delete result;
+                return nullptr;
+            }
+            int outwanted = std::min(chunklen,outframes-outpos);
+            WDL_ResampleSample* rsinbuf = nullptr;
+            int inwanted = rs.ResamplePrepare(outwanted,chans,&rsinbuf);
+            for (int i=0;i<inwanted;++i)
+            {
+                for (unsigned int j=0;j<chans;++j)
+                {
+                    if (inpos+i<inframes)
+                        rsinbuf[i*chans+j] = src.getSample(inpos+i,j);
+                    else rsinbuf[i*chans+j] = 0.0f;
+                }
+            }
+            inpos += inwanted;
+            int got = rs.ResampleOut(outchunk.data(),inwanted,outwanted,chans);
+            if (got <= 0)
+                break;
+            result->writeFrames(outpos,outchunk.data(),got);
+            outpos += got;
+            progress = (double)outpos/outframes;
+        }
+        result->silenceFrom(outpos);
+        return result;
+    }
+    // Loads the file on a background thread, the current buffer keeps playing
+    // until the new one is ready. The decoding waits its turn in the LoadScheduler.
+    // Call from the GUI thread.
+    void importFileAsync(std::string filename)
+    {
+        cancelLoading();
+        {
+            std::lock_guard<std::mutex> locker(m_writeMut);
+            m_loadingFile = filename;
+            m_loading = true;
+            m_lastError.clear();
+        }
+        m_cancelLoad = false;
+        m_loadProgress = 0.0f;
+        m_loadOrder = LoadScheduler::instance().nextOrder();
+        m_loaderThread = std::thread([this,filename]() { loaderTask(filename); });
+    }
+    // Converts the source to the new rate in the background, or picks up a previously 
+    // converted buffer from the cache. Until then the grains compensate for the rate 
+    // difference themselves. Call from the GUI thread.
+    void setEngineSampleRate(float sr)
+    {
+        bool startLoader = false;
+        {
+            std::lock_guard<std::mutex> locker(m_writeMut);
+            m_engineSampleRate = sr;
+            if (!m_loading)
+            {
+                m_loading = true;
+                startLoader = true;
+            }
+        }
+        if (startLoader)
+        {
+            if (m_loaderThread.joinable())
+                m_loaderThread.join();
+            m_cancelLoad = false;
+            m_loadProgress = 0.0f;
+            m_loaderThread = std::thread([this]() { loaderTask(""); });
+        }
+    }
+    // Files that would take more memory than this when decoded to floats are 
+    // memory mapped instead, if they are plain PCM or float WAV files
+    static const drwav_uint64 StreamingThresholdBytes = 256*1024*1024;
+    static DrWavBuffer* openMapped(std::string filename)
+    {
+        drwav wav;
+        if (!drwav_init_file(&wav, filename.c_str(), nullptr))
+            return nullptr;
+        drwav_uint64 decodedbytes = wav.totalPCMFrameCount*wav.channels*sizeof(float);
+        drwav_uninit(&wav);
+        if (decodedbytes < StreamingThresholdBytes)
+            return nullptr;
+        MappedWavFile* mapped = new MappedWavFile;
+        if (!mapped->open(filename))
+        {
+            delete mapped;
+            return nullptr;
+        }
+        return new DrWavBuffer(mapped);
+    }
+    std::atomic<bool> m_streamLargeFiles{true};
+    // files loaded into memory are stored as 16 bit integers instead of floats
+    std::atomic<bool> m_compactStorage{false};
+    void cancelLoading()
+    {
+        m_cancelLoad = true;
+        if (m_loaderThread.joinable())
+            m_loaderThread.join();
+        m_loading = false;
+    }
+    bool isLoading() { return m_loading; }
+    // Why the last load or edit failed, empty if it didn't. For the widget to show.
+    std::string getLastError()
+    {
+        std::lock_guard<std::mutex> locker(m_writeMut);
+        return m_lastError;
+    }
+    void clearError()
+    {
+        std::lock_guard<std::mutex> locker(m_writeMut);
+        m_lastError.clear();
+    }
+    float getLoadProgress() { return m_loadProgress; }
+    // The file that is playing, or the one that will be once loading finishes
+    std::string getFileName()
+    {
+        std::lock_guard<std::mutex> locker(m_writeMut);
+        if (m_loading && !m_loadingFile.empty())
+            return m_loadingFile;
+        return m_currentFile;
+    }
+    // Swaps in a new buffer for the audio thread. The old buffer is retired and
+    // released once the audio thread is no longer reading from it. Not to be called 
+    // from the audio thread.
+    void publishBuffer(std::shared_ptr<DrWavBuffer> buf, bool rebuildPeaks = true)
+    {
+        if (rebuildPeaks)
+            updatePeaks(*buf);
+        std::lock_guard<std::mutex> locker(m_writeMut);
+        publishBufferLocked(buf);
+    }
+    void publishBufferLocked(std::shared_ptr<DrWavBuffer> buf)
+    {
+        m_channels = buf->channels();
+        m_sampleRate = buf->sampleRate();
+        m_totalPCMFrameCount = buf->size();
+        m_current.store(buf.get());
+        if (m_currentOwner)
+            m_retired.push_back(m_currentOwner);
+        m_currentOwner = buf;
+        collectGarbageLocked();
+        if (buf->mappedFile() && !m_prefetchThread.joinable())
+            m_prefetchThread = std::thread([this](){ prefetchLoop(); });
+    }
+    // Called periodically from the GUI thread to release retired buffers
+    void collectGarbage()
+    {
+        std::lock_guard<std::mutex> locker(m_writeMut);
+        collectGarbageLocked();
+    }
+    // written by whichever thread published the buffer, lock m_peaksMut when reading
+    PeakPyramid m_peaks;
+    std::mutex m_peaksMut;
+    // Starts out silent, files are only loaded on request
+    DrWavSource()
+    {
+        
+    }
+    // Called by the widget when it draws, loads for modules on screen are done first
+    void markVisible()
+    {
+        m_lastVisibleTime = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    bool isVisible()
+    {
+        double now = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        return now-m_lastVisibleTime < 0.5;
+    }
+    // Waiting for other loads to finish before this one can start
+    bool isQueued() { return m_queued; }
+    // Voices past this many aren't prefetched for
+    static const int MaxReadVoices = 16;
+    // Remembered for the prefetcher
+    void noteVoiceRead(int voice, const GrainReadRegion& region) override
+    {
+        if (voice<0 || voice>=MaxReadVoices)
+            return;
+        VoiceReadHint& hint = m_voiceReads[voice];
+        hint.position.store(region.position);
+        hint.start.store(region.start);
+        hint.end.store(region.end);
+        hint.framesPerSecond.store(region.framesPerSecond);
+        hint.loopStart.store(region.loopStart);
+        hint.loopEnd.store(region.loopEnd);
+        ++hint.updates;
+    }
+    // Frames of streamed files the grains wanted before the prefetcher had loaded them,
+    // those were played as silence
+    std::atomic<int64_t> m_streamMissFrames{0};
+    void putIntoBuffer(float* dest, int frames, int channels, int startInSource) override
+    {
+        DrWavBuffer* buf = pinBuffer();
+        if (buf==nullptr || buf->channels()==0)
+        {
+            unpinBuffer();
+            for (int i=0;i<frames*channels;++i)
+                dest[i]=0.0f;
+            return;
+        }
+        // streamed files are only read from the decoded blocks in memory, never from the mapping
+        if (buf->mappedFile())
+        {
+            int missing = m_streamCache.read(buf->mappedFile(),dest,frames,channels,startInSource,
+                [](int srcchans, int chan) { return mapSourceChannel(srcchans,chan); });
+            if (missing > 0)
+                m_streamMissFrames += missing;
+            unpinBuffer();
+            return;
+        }
+        int srcchans = buf->channels();
+        drwav_uint64 numframes = buf->size();
+        for (int i=0;i<frames;++i)
+        {
+            drwav_int64 index = i+startInSource;
+            if (index>=0 && index<(drwav_int64)numframes)
+            {
+                for (int j=0;j<channels;++j)
+                {
+                    int actsrcchan = mapSourceChannel(srcchans,j);
+                    dest[i*channels+j] = buf->getSample(index,actsrcchan);
+                }
+            } else
+            {
+                for (int j=0;j<channels;++j)
+                {
+                    dest[i*channels+j] = 0.0f;
+                }
+            }
+        }
+        unpinBuffer();
+    }
+    bool acquireSourceSpan(GrainSourceSpan& span) override
+    {
+        DrWavBuffer* buf = pinBuffer();
+        if (buf==nullptr || buf->channels()==0 || buf->mappedFile()
+            || (buf->floatData()==nullptr && buf->int16Data()==nullptr))
+        {
+            unpinBuffer();
+            return false;
+        }
+        span.data = buf->floatData();
+        span.data16 = span.data ? nullptr : buf->int16Data();
+        span.numFrames = buf->size();
+        span.numChannels = buf->channels();
+        return true;
+    }
+    void releaseSourceSpan() override
+    {
+        unpinBuffer();
+    }
+    ~DrWavSource()
+    {
+        {
+            std::lock_guard<std::mutex> locker(m_editMut);
+            m_editQueue.clear();
+        }
+        if (m_editThread.joinable())
+            m_editThread.join();
+        cancelLoading();
+        m_stopPrefetch = true;
+        if (m_prefetchThread.joinable())
+            m_prefetchThread.join();
+    }
+    int getSourceNumChannels() override
+    {
+        return m_channels;
+    }
+    int getSourceNumSamples() override
+    {
+        return m_totalPCMFrameCount;
+    }
+    float getSourceSampleRate() override
+    {
+        return m_sampleRate;
+    }
+private:
+    void loaderTask(std::string filename)
+    {
+        if (!filename.empty())
+        {
+            m_queued = true;
+            bool go = LoadScheduler::instance().acquire(LoadScheduler::LS_Decode,m_loadOrder,
+                [this]() { return isVisible(); },m_cancelLoad);
+            m_queued = false;
+            std::shared_ptr<DrWavBuffer> buf;
+            if (go)
+            {
+                buf = loadPooled(filename);
+                LoadScheduler::instance().release();
+            }
+            if (!buf && !m_cancelLoad)
+            {
+                std::lock_guard<std::mutex> locker(m_writeMut);
+                m_lastError = "Could not load file";
+            }
+            if (buf)
+            {
+                // play at the file's own rate while the conversion runs
+                publishBuffer(buf);
+                std::lock_guard<std::mutex> locker(m_writeMut);
+                m_original = buf;
+                m_edited = false;
+                m_rateCache.clear();
+                m_currentFile = filename;
+            }
+        }
+        while (true)
+        {
+            std::shared_ptr<DrWavBuffer> original;
+            unsigned int rate = 0;
+            std::shared_ptr<DrWavBuffer> target;
+            {
+                std::lock_guard<std::mutex> locker(m_writeMut);
+                original = m_original;
+                rate = m_engineSampleRate;
+                auto it = m_rateCache.find(std::make_pair(m_currentFile,rate));
+                if (it != m_rateCache.end())
+                    target = it->second;
+            }
+            if (!target && original)
+            {
+                // streamed files stay at their own rate, converting would defeat the point
+                if (rate == 0 || original->sampleRate() == rate || original->mappedFile())
+                    target = original;
+                else
+                {
+                    std::string filename;
+                    bool edited = false;
+                    {
+                        std::lock_guard<std::mutex> locker(m_writeMut);
+                        filename = m_currentFile;
+                        edited = m_edited;
+                    }
+                    // another module may have converted the same file already
+                    if (!edited)
+                        target = SamplePool::instance().find(filename,rate,original->storage());
+                    if (!target)
+                    {
+                        DrWavBuffer* converted = nullptr;
+                        if (LoadScheduler::instance().acquire(LoadScheduler::LS_Convert,m_loadOrder,
+                            [this]() { return isVisible(); },m_cancelLoad))
+                        {
+                            m_loadProgress = 0.0f;
+                            converted = convertSampleRate(*original,rate,m_loadProgress,m_cancelLoad);
+                            LoadScheduler::instance().release();
+                        }
+                        if (converted)
+                        {
+                            target.reset(converted);
+                            if (!edited)
+                                SamplePool::instance().add(filename,rate,original->storage(),target);
+                        }
+                    }
+                    if (target)
+                    {
+                        std::lock_guard<std::mutex> locker(m_writeMut);
+                        if (m_original == original)
+                            m_rateCache[std::make_pair(m_currentFile,rate)] = target;
+                    }
+                }
+            }
+            if (target && target.get() != m_current.load())
+                publishBuffer(target,false);
+            std::lock_guard<std::mutex> locker(m_writeMut);
+            if (m_cancelLoad || (unsigned int)m_engineSampleRate == rate)
+            {
+                m_loading = false;
+                break;
+            }
+        }
+    }
+    // Gets the file's buffer from the sample pool, loading it only if no other module has it
+    std::shared_ptr<DrWavBuffer> loadPooled(std::string filename)
+    {
+        bool streamed = m_streamLargeFiles;
+        std::shared_ptr<DrWavBuffer> result;
+        if (streamed)
+        {
+            result = SamplePool::instance().acquire(filename,0,DrWavBuffer::ST_Mapped,
+                [filename]() { return openMapped(filename); },m_cancelLoad);
+        }
+        if (!result)
+        {
+            DrWavBuffer::Storage storage = m_compactStorage ? DrWavBuffer::ST_Int16 : DrWavBuffer::ST_Float;
+            result = SamplePool::instance().acquire(filename,0,storage,
+                [this,filename,storage]() { return decodeFile(filename,m_loadProgress,m_cancelLoad,storage); },
+                m_cancelLoad);
+        }
+        return result;
+    }
+    // The audio thread announces the buffer it is about to read in m_inUse
+    // and then checks it is still the current one, so a writer can't have retired 
+    // and released it in between. Lock free and wait free for the audio thread.
+    DrWavBuffer* pinBuffer()
+    {
+        DrWavBuffer* buf = nullptr;
+        do
+        {
+            buf = m_current.load();
+            m_inUse.store(buf);
+        } while (buf != m_current.load());
+        return buf;
+    }
+    void unpinBuffer()
+    {
+        m_inUse.store(nullptr);
+    }
+    void editTask()
+    {
+        while (true)
+        {
+            BufferEditFunc func;
+            EditDoneFunc onDone;
+            {
+                std::lock_guard<std::mutex> locker(m_editMut);
+                if (m_editQueue.empty())
+                {
+                    m_editing = false;
+                    return;
+                }
+                std::tie(func,onDone) = m_editQueue.front();
+                m_editQueue.pop_front();
+            }
+            std::shared_ptr<DrWavBuffer> current = getEditableBuffer();
+            if (!current)
+                continue;
+            // the edits work on floats, 16 bit buffers are converted for the edit and back after it
+            bool int16 = current->storage() == DrWavBuffer::ST_Int16;
+            std::shared_ptr<DrWavBuffer> src = current;
+            if (int16)
+                src.reset(current->clone());
+            std::shared_ptr<DrWavBuffer> edited(func(*src));
+            if (edited && int16)
+                edited.reset(edited->cloneAsInt16());
+            if (!edited)
+                continue;
+            if (setEditedBuffer(edited,current))
+            {
+                if (onDone)
+                    onDone();
+            } else
+            {
+                std::lock_guard<std::mutex> locker(m_writeMut);
+                m_lastError = "Sample changed, edit discarded";
+            }
+        }
+    }
+    std::shared_ptr<DrWavBuffer> getEditableBuffer()
+    {
+        std::lock_guard<std::mutex> locker(m_writeMut);
+        if (!m_currentOwner || m_currentOwner->channels() == 0 || m_currentOwner->size() == 0)
+            return nullptr;
+        if (m_currentOwner->storage() == DrWavBuffer::ST_Mapped)
+        {
+            m_lastError = "Not available for streamed files";
+            return nullptr;
+        }
+        return m_currentOwner;
+    }
+    // An edited buffer replaces the original, the converted versions of the file are stale.
+    // Returns false without publishing if another buffer was published while the edit ran.
+    bool setEditedBuffer(std::shared_ptr<DrWavBuffer> buf, std::shared_ptr<DrWavBuffer> editedFrom)
+    {
+        PeakPyramid peaks;
+        peaks.build(*buf);
+        std::lock_guard<std::mutex> locker(m_writeMut);
+        if (m_currentOwner != editedFrom)
+            return false;
+        publishBufferLocked(buf);
+        {
+            std::lock_guard<std::mutex> peaklocker(m_peaksMut);
+            m_peaks = std::move(peaks);
+        }
+        m_original = buf;
+        m_edited = true;
+        m_rateCache.clear();
+        return true;
+    }
+    void collectGarbageLocked()
+    {
+        DrWavBuffer* inuse = m_inUse.load();
+        for (int i=(int)m_retired.size()-1;i>=0;--i)
+        {
+            if (m_retired[i].get() != inuse)
+                m_retired.erase(m_retired.begin()+i);
+        }
+    }
+    // Adds the cache blocks the voice will read in the next PrefetchSeconds with their distance
+    // from where it reads now, in frames
+    static void addReadCandidates(const GrainReadRegion& r, int numBlocks,
+        std::vector<std::pair<double,int>>& candidates)
+    {
+        const double PrefetchSeconds = 1.0;
+        const double blockframes = MappedWavCache::BlockFrames;
+        double travel = std::fabs(r.framesPerSecond)*PrefetchSeconds;
+        double looplen = r.loopEnd-r.loopStart;
+        for (double d=0.0;d<=travel;d+=blockframes)
+        {
+            double pos = r.position+(r.framesPerSecond<0.0 ? -d : d);
+            if (looplen>0.0)
+            {
+                pos = r.loopStart+std::fmod(pos-r.loopStart,looplen);
+                if (pos<r.loopStart)
+                    pos += looplen;
+            }
+            int block0 = std::max(std::floor((pos-(r.position-r.start))/blockframes),0.0);
+            int block1 = std::min(std::floor((pos+(r.end-r.position))/blockframes),numBlocks-1.0);
+            for (int i=block0;i<=block1;++i)
+                candidates.push_back(std::make_pair(d,i));
+        }
+    }
+    // Keeps the blocks the voices are about to read resident in the stream cache, most urgent
+    // first: the regions the voices read from now, then further along their direction of play.
+    // The disk access is done without holding m_writeMut, the buffer is kept alive by its own
+    // reference.
+    void prefetchLoop()
+    {
+        std::shared_ptr<DrWavBuffer> cached;
+        std::array<uint32_t,MaxReadVoices> lastupdates{};
+        std::array<std::chrono::steady_clock::time_point,MaxReadVoices> lastseen{};
+        std::vector<std::pair<double,int>> candidates;
+        std::vector<int> wanted;
+        std::vector<bool> added;
+        while (!m_stopPrefetch)
+        {
+            std::shared_ptr<DrWavBuffer> cur;
+            {
+                std::lock_guard<std::mutex> locker(m_writeMut);
+                cur = m_currentOwner;
+            }
+            if (cur && !cur->mappedFile())
+                cur.reset();
+            if (cur != cached)
+            {
+                m_streamCache.setFile(cur ? cur->mappedFile() : nullptr);
+                cached = cur;
+                added.assign(m_streamCache.numBlocks(),false);
+            }
+            int loaded = 0;
+            if (cached)
+            {
+                auto now = std::chrono::steady_clock::now();
+                candidates.clear();
+                for (int i=0;i<MaxReadVoices;++i)
+                {
+                    const VoiceReadHint& hint = m_voiceReads[i];
+                    uint32_t updates = hint.updates.load();
+                    if (updates != lastupdates[i])
+                    {
+                        lastupdates[i] = updates;
+                        lastseen[i] = now;
+                    }
+                    // voices that haven't started grains for a while have stopped
+                    if (updates == 0 || now-lastseen[i] > std::chrono::seconds(2))
+                        continue;
+                    GrainReadRegion region;
+                    region.position = hint.position.load();
+                    region.start = hint.start.load();
+                    region.end = hint.end.load();
+                    region.framesPerSecond = hint.framesPerSecond.load();
+                    region.loopStart = hint.loopStart.load();
+                    region.loopEnd = hint.loopEnd.load();
+                    addReadCandidates(region,m_streamCache.numBlocks(),candidates);
+                }
+                std::sort(candidates.begin(),candidates.end());
+                wanted.clear();
+                for (auto& c : candidates)
+                {
+                    if (!added[c.second])
+                    {
+                        added[c.second] = true;
+                        wanted.push_back(c.second);
+                    }
+                }
+                for (int block : wanted)
+                    added[block] = false;
+                loaded = m_streamCache.update(wanted);
+            }
+            cur.reset();
+            // keeps loading while there are blocks missing
+            if (loaded == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        m_streamCache.setFile(nullptr);
+    }
+    std::atomic<DrWavBuffer*> m_current{nullptr};
+    std::atomic<DrWavBuffer*> m_inUse{nullptr};
+    // the rest is only touched from non-audio threads
+    std::mutex m_writeMut;
+    std::shared_ptr<DrWavBuffer> m_currentOwner;
+    std::vector<std::shared_ptr<DrWavBuffer>> m_retired;
+    // the buffer at the file's sample rate, or the latest edit of it
+    std::shared_ptr<DrWavBuffer> m_original;
+    std::map<std::pair<std::string,unsigned int>,std::shared_ptr<DrWavBuffer>> m_rateCache;
+    // the original no longer matches the file on disk, so it can't be shared through the pool
+    bool m_edited = false;
+    std::atomic<float> m_engineSampleRate{0.0f};
+    std::string m_currentFile;
+    std::string m_loadingFile;
+    std::string m_lastError;
+    std::thread m_loaderThread;
+    std::atomic<bool> m_loading{false};
+    std::atomic<bool> m_queued{false};
+    std::atomic<double> m_lastVisibleTime{0.0};
+    uint64_t m_loadOrder = 0;
+    std::atomic<bool> m_cancelLoad{false};
+    std::atomic<float> m_loadProgress{0.0f};
+    std::thread m_prefetchThread;
+    std::atomic<bool> m_stopPrefetch{false};
+    // written by the audio thread, read by the prefetcher. The fields of a voice may be
+    // updated while they are read, which only makes the prefetcher's guess a little off.
+    struct VoiceReadHint
+    {
+        std::atomic<double> position{0.0};
+        std::atomic<double> start{0.0};
+        std::atomic<double> end{0.0};
+        std::atomic<double> framesPerSecond{0.0};
+        std::atomic<double> loopStart{0.0};
+        std::atomic<double> loopEnd{0.0};
+        std::atomic<uint32_t> updates{0};
+    };
+    std::array<VoiceReadHint,MaxReadVoices> m_voiceReads;
+    // written by the prefetch thread, read by the audio thread
+    MappedWavCache m_streamCache;
+    std::mutex m_editMut;
+    std::deque<std::pair<BufferEditFunc,EditDoneFunc>> m_editQueue;
+    std::thread m_editThread;
+    std::atomic<bool> m_editing{false};
+};
@@ -2,8 +2,10 @@
 
 #include <array>
 #include <vector>
+#include <cstdint>
 #include <cmath>
 #include <random>
+#include <queue>
 // #include "../plugin.hpp"
 #include "../wdl/resample.h"
 
@@ -22,6 +24,45 @@ inline float rescale(float x, float xMin, float xMax, float yMin, float yMax) {
 }
 }
 
+// Which source channel feeds a grain output channel when the channel counts differ
+inline int mapSourceChannel(int srcchans, int outchan)
+{
+    const int srcchanmap[4][4]=
+    {
+        {0,0,0,0},
+        {0,1,0,1},
+        {0,1,2,0},
+        {0,1,2,3}
+    };
+    if (srcchans>=1 && srcchans<=4 && outchan<4)
+        return srcchanmap[srcchans-1][outchan];
+    return outchan % srcchans;
+}
+
+// Interleaved source audio that can be read in place, either as floats
+// or as 16 bit integers (data16) when data is null
+struct GrainSourceSpan
+{
+    const float* data = nullptr;
+    const int16_t* data16 = nullptr;
+    int numFrames = 0;
+    int numChannels = 0;
+};
+
+// Where the grains of a voice read from, for sources that stream from disk. Positions are
+// in source frames. The grains the voice starts now read within start..end around position,
+// the region moves at framesPerSecond (negative when playing backwards) and position wraps
+// around within the loop.
+struct GrainReadRegion
+{
+    double position = 0.0;
+    double start = 0.0;
+    double end = 0.0;
+    double framesPerSecond = 0.0;
+    double loopStart = 0.0;
+    double loopEnd = 0.0;
+};
+
 class GrainAudioSource
 {
 public:
@@ -30,6 +71,13 @@ public:
     virtual int getSourceNumSamples() { return 0; };
     virtual int getSourceNumChannels() { return 0; };
     virtual void putIntoBuffer(float* dest, int frames, int channels, int startInSource) = 0;
+    // Sources that hold their audio in contiguous memory can return true here,
+    // the grains then read directly from the span instead of calling putIntoBuffer.
+    // The span must stay valid until releaseSourceSpan is called.
+    virtual bool acquireSourceSpan(GrainSourceSpan& span) { return false; }
+    virtual void releaseSourceSpan() {}
+    // Called from the audio thread when a voice starts a grain, before the grain reads
+    virtual void noteVoiceRead(int voice, const GrainReadRegion& region) {}
 };
 
 class WindowLookup
@@ -49,74 +97,169 @@ public:
         int index = normpos*(m_size-1);
         return m_table[index];
     }
+    // The table is read only after construction, so all grains can share one
+    static WindowLookup& getHann()
+    {
+        static WindowLookup hann;
+        return hann;
+    }
 private:
     std::vector<float> m_table;
     int m_size = 32768;
 };
 
-
-class ISGrain
+// Equal power gains for placing a mono grain between 2 outputs (left to right) or 
+// around a ring of 4 or 8 outputs. Gains for the unused outputs are zero, so a 
+// grain can always be mixed into MaxOutputs channels.
+class PanGainTable
 {
 public:
-    WindowLookup m_hannwind;
-    ISGrain() 
+    static const int MaxOutputs = 8;
+    static const int Resolution = 512;
+    PanGainTable(int numouts)
+    {
+        m_table.resize((Resolution+1)*MaxOutputs);
+        for (int i=0;i<=Resolution;++i)
+        {
+            float pos = (float)i/Resolution;
+            float* gains = &m_table[i*MaxOutputs];
+            if (numouts == 2)
+            {
+                gains[0] = std::cos(pos*3.141592653f*0.5f);
+                gains[1] = std::sin(pos*3.141592653f*0.5f);
+                continue;
+            }
+            float ringpos = pos*numouts;
+            int out0 = (int)ringpos % numouts;
+            int out1 = (out0+1) % numouts;
+            float frac = ringpos-std::floor(ringpos);
+            gains[out0] = std::cos(frac*3.141592653f*0.5f);
+            gains[out1] = std::sin(frac*3.141592653f*0.5f);
+        }
+    }
+    // pos is 0..1, for the rings 0 and 1 are the same place
+    const float* getGains(float pos) const
     {
-        m_grainOutBuffer.resize(65536*m_chans*2);
+        int index = xenakios::clamp(pos,0.0f,1.0f)*Resolution;
+        return &m_table[index*MaxOutputs];
     }
-    bool initGrain(float inputdur, float startInSource,float len, float pitch)
+    // numouts must be 2, 4 or 8
+    static const PanGainTable& get(int numouts)
     {
-        if (playState == 1)
+        static const PanGainTable stereo(2);
+        static const PanGainTable quad(4);
+        static const PanGainTable octo(8);
+        if (numouts == 2)
+            return stereo;
+        if (numouts == 4)
+            return quad;
+        return octo;
+    }
+private:
+    std::vector<float> m_table;
+};
+
+class ISGrain
+{
+public:
+    WindowLookup& m_hannwind = WindowLookup::getHann();
+    // The grain is rendered as it is mixed, this many frames at a time at most, so the
+    // memory for a grain doesn't depend on its length and no block has to render a whole
+    // grain.
+    static const int RenderFrames = 64;
+    static const int MaxChannels = 16;
+    ISGrain() {}
+    // rateratio is the source sample rate divided by the output sample rate.
+    // onsetoffset (0..1) is how far past the grain's onset time the first output 
+    // sample is, for sub-sample accurate grain timing.
+    bool initGrain(float inputdur, float startInSource,float len, float pitch, float rateratio = 1.0f,
+        float onsetoffset = 0.0f)
+    {
+        int lensamples = m_sr*len;
+        if (playState == 1 || lensamples < 2)
             return false;
         playState = 1;
         m_outpos = 0;
-        m_resampler.SetRates(m_sr , m_sr / std::pow(2.0,1.0/12*pitch));
-        float* rsinbuf = nullptr;
-        int lensamples = m_sr*len;
         m_grainSize = lensamples;
-        m_resampler.Reset();
-        int wanted = m_resampler.ResamplePrepare(lensamples,m_chans,&rsinbuf);
-        
+        m_onsetOffset = onsetoffset;
         int srcpossamples = startInSource;
         //srcpossamples+=rack::random::normal()*lensamples;
         srcpossamples = xenakios::clamp((float)srcpossamples,(float)0,inputdur-1.0f);
-        m_syn->putIntoBuffer(rsinbuf,wanted,m_chans,srcpossamples);
-        m_resampler.ResampleOut(m_grainOutBuffer.data(),wanted,lensamples,m_chans);
-        for (int i=0;i<lensamples;++i)
-        {
-            float hannpos = 1.0/(m_grainSize-1)*i;
-            //hannpos = fmod(hannpos+m_storedOffset,1.0f);
-            //float win = getWindow(hannpos,1); 
-            //float win = 0.5f * (1.0f - std::cos(2.0f * 3.141592653 * hannpos));
-            float win = m_hannwind.getValue(hannpos);
-            for (int j=0;j<m_chans;++j)
-            {
-                m_grainOutBuffer[i*m_chans+j]*=win;
-            }
-            
+        m_ratio = std::pow(2.0,1.0/12*pitch)*rateratio;
+        // the span read doesn't low pass filter, so grains pitched up go through the resampler
+        GrainSourceSpan span;
+        m_readsSpan = m_ratio <= 1.0 && m_syn->acquireSourceSpan(span);
+        if (m_readsSpan)
+        {
+            m_syn->releaseSourceSpan();
+            m_spanPos = srcpossamples+onsetoffset*m_ratio;
+        }
+        else
+        {
+            m_resampler.SetRates(m_sr , m_sr / m_ratio);
+            m_resampler.Reset();
+            m_resamplerReadPos = srcpossamples;
         }
         return true;
     }
+    // Stops the grain if it's playing, it was rendering for the old channel count
     void setNumOutChans(int chans)
     {
-        m_chans = chans;
+        m_chans = std::min(chans,(int)MaxChannels);
+        playState = 0;
+        m_outpos = 0;
     }
-    void process(float* buf)
+    void setPanGains(const float* gains)
     {
-        
-        for (int i=0;i<m_chans;++i)
+        for (int i=0;i<PanGainTable::MaxOutputs;++i)
+            m_panGains[i] = gains[i];
+    }
+    // Mixes up to nframes of the first grain channel into PanGainTable::MaxOutputs outputs
+    // with the pan gains, output i at buf[i*stride]. Outputs the grain isn't panned to are
+    // skipped.
+    void mixPanned(float* buf, int stride, int nframes)
+    {
+        while (nframes>0 && playState==1)
         {
-            buf[i] += m_grainOutBuffer[m_outpos*m_chans+i];
+            const int numframes = std::min(std::min(nframes,(int)RenderFrames),m_grainSize-m_outpos);
+            render(numframes);
+            const float* src = m_renderBuffer;
+            for (int i=0;i<PanGainTable::MaxOutputs;++i)
+            {
+                const float gain = m_panGains[i];
+                if (gain == 0.0f)
+                    continue;
+                float* dest = buf+i*stride;
+                for (int j=0;j<numframes;++j)
+                    dest[j] += src[j*m_chans]*gain;
+            }
+            advance(numframes);
+            buf += numframes;
+            nframes -= numframes;
         }
-        ++m_outpos;
-        
-        if (m_outpos>=m_grainSize)
+    }
+    // Mixes up to nframes of the grain into buf, grain channel i at buf[i*stride]. Chans must
+    // match m_chans, or be 0 to use m_chans at runtime. The caller picks it once for its
+    // channel configuration, so the inner loops have a fixed layout.
+    template<int Chans>
+    void mix(float* buf, int stride, int nframes)
+    {
+        const int chans = Chans > 0 ? Chans : m_chans;
+        while (nframes>0 && playState==1)
         {
-            m_outpos = 0;
-            playState = 0;
+            const int numframes = std::min(std::min(nframes,(int)RenderFrames),m_grainSize-m_outpos);
+            render(numframes);
+            const float* src = m_renderBuffer;
+            for (int i=0;i<chans;++i)
+            {
+                float* dest = buf+i*stride;
+                for (int j=0;j<numframes;++j)
+                    dest[j] += src[j*chans+i];
+            }
+            advance(numframes);
+            buf += numframes;
+            nframes -= numframes;
         }
-        
-        
-        
     }
     int playState = 0;
     void setSampleRate(float sr)
@@ -141,36 +284,196 @@ public:
     }
     GrainAudioSource* m_syn = nullptr;
 private:
-    
+    // The next numframes frames of the grain into m_renderBuffer, windowed
+    void render(int numframes)
+    {
+        if (m_readsSpan)
+        {
+            GrainSourceSpan span;
+            if (m_syn->acquireSourceSpan(span))
+            {
+                if (span.data)
+                    renderSpan(span.data,1.0f,span,numframes);
+                else
+                    renderSpan(span.data16,1.0f/32768.0f,span,numframes);
+                m_syn->releaseSourceSpan();
+            } else
+            {
+                // the source changed to one that can't be read in place
+                std::fill(m_renderBuffer,m_renderBuffer+numframes*m_chans,0.0f);
+            }
+        } else
+        {
+            float* rsinbuf = nullptr;
+            int wanted = m_resampler.ResamplePrepare(numframes,m_chans,&rsinbuf);
+            m_syn->putIntoBuffer(rsinbuf,wanted,m_chans,m_resamplerReadPos);
+            m_resamplerReadPos += wanted;
+            int got = m_resampler.ResampleOut(m_renderBuffer,wanted,numframes,m_chans);
+            std::fill(m_renderBuffer+got*m_chans,m_renderBuffer+numframes*m_chans,0.0f);
+        }
+        switch (m_chans)
+        {
+        case 1: applyWindow<1>(numframes); break;
+        case 2: applyWindow<2>(numframes); break;
+        case 4: applyWindow<4>(numframes); break;
+        default: applyWindow<0>(numframes);
+        }
+    }
+    void advance(int numframes)
+    {
+        m_outpos += numframes;
+        if (m_outpos>=m_grainSize)
+        {
+            m_outpos = 0;
+            playState = 0;
+        }
+    }
+    template<typename T>
+    void renderSpan(const T* data, float scale, const GrainSourceSpan& span, int numframes)
+    {
+        switch (m_chans)
+        {
+        case 1: renderFromSpan<1>(data,scale,span,numframes); break;
+        case 2: renderFromSpan<2>(data,scale,span,numframes); break;
+        case 4: renderFromSpan<4>(data,scale,span,numframes); break;
+        default: renderFromSpan<0>(data,scale,span,numframes);
+        }
+    }
+    // 4 point Hermite interpolating read straight from the source memory, no intermediate copy.
+    // There is no low pass filtering, so this is only used when the source is read at its own
+    // rate or slower. Samples are multiplied by scale to bring integer data to the -1..1 range.
+    // Chans is the grain channel count, 0 for any count. Continues from m_spanPos.
+    template<int Chans, typename T>
+    void renderFromSpan(const T* data, float scale, const GrainSourceSpan& span, int numframes)
+    {
+        const int chans = Chans > 0 ? Chans : m_chans;
+        int chanmap[MaxChannels];
+        for (int j=0;j<chans;++j)
+            chanmap[j] = mapSourceChannel(span.numChannels,j);
+        const int srcchans = span.numChannels;
+        const int lastFrame = span.numFrames-1;
+        const double ratio = m_ratio;
+        double srcpos = m_spanPos;
+        for (int i=0;i<numframes;++i)
+        {
+            int index0 = srcpos;
+            float frac = srcpos-index0;
+            float* out = &m_renderBuffer[i*chans];
+            if (index0>=0 && index0<lastFrame)
+            {
+                // the outer points are repeated at the ends of the source
+                const T* frame0 = data+std::max(index0-1,0)*srcchans;
+                const T* frame1 = data+index0*srcchans;
+                const T* frame2 = frame1+srcchans;
+                const T* frame3 = data+std::min(index0+2,lastFrame)*srcchans;
+                for (int j=0;j<chans;++j)
+                {
+                    float y0 = frame0[chanmap[j]]*scale;
+                    float y1 = frame1[chanmap[j]]*scale;
+                    float y2 = frame2[chanmap[j]]*scale;
+                    float y3 = frame3[chanmap[j]]*scale;
+                    float c1 = 0.5f*(y2-y0);
+                    float c2 = y0-2.5f*y1+2.0f*y2-0.5f*y3;
+                    float c3 = 0.5f*(y3-y0)+1.5f*(y1-y2);
+                    out[j] = ((c3*frac+c2)*frac+c1)*frac+y1;
+                }
+            } else
+            {
+                for (int j=0;j<chans;++j)
+                    out[j] = 0.0f;
+            }
+            srcpos += ratio;
+        }
+        m_spanPos = srcpos;
+    }
+    template<int Chans>
+    void applyWindow(int numframes)
+    {
+        const int chans = Chans > 0 ? Chans : m_chans;
+        const double winscale = 1.0/(m_grainSize-1);
+        float* out = m_renderBuffer;
+        for (int i=0;i<numframes;++i)
+        {
+            float hannpos = std::min(winscale*(m_outpos+i+m_onsetOffset),1.0);
+            float win = m_hannwind.getValue(hannpos);
+            for (int j=0;j<chans;++j)
+                out[i*chans+j]*=win;
+        }
+    }
+    alignas(16) float m_panGains[PanGainTable::MaxOutputs] = {};
     int m_outpos = 0;
     int m_grainSize = 2048;
     float m_sr = 44100.0f;
     int m_chans = 2;
+    float m_onsetOffset = 0.0f;
+    // source frames per output frame
+    double m_ratio = 1.0;
+    // grains read at the source rate or slower read the source memory in place from
+    // m_spanPos, the others go through the resampler, which reads from m_resamplerReadPos
+    bool m_readsSpan = false;
+    double m_spanPos = 0.0;
+    int m_resamplerReadPos = 0;
     WDL_Resampler m_resampler;
-    std::vector<float> m_grainOutBuffer;
-    
+    float m_renderBuffer[RenderFrames*MaxChannels];
 };
 
 
 
+// Grain streams are scheduled independently of each other. Synchronous streams start
+// grains at regular intervals, optionally jittered, asynchronous ones at Poisson
+// distributed times with the same average rate.
+enum GrainStreamType
+{
+    GST_Synchronous,
+    GST_Asynchronous
+};
+
+struct GrainStream
+{
+    bool enabled = false;
+    GrainStreamType type = GST_Synchronous;
+    // relative to the grain rate of the mixer
+    float rateMultiplier = 1.0f;
+};
+
+// A grain due to start, onset is in output samples since the mixer started
+struct GrainEvent
+{
+    GrainEvent() {}
+    GrainEvent(double onset_, int stream_) : onset(onset_), stream(stream_) {}
+    double onset = 0.0;
+    int stream = 0;
+    // reversed, so that the priority queue gives the earliest event first
+    bool operator<(const GrainEvent& other) const { return onset > other.onset; }
+};
+
 class GrainMixer
 {
 public:
+    static const int MaxStreams = 4;
     GrainAudioSource* m_syn = nullptr;
     GrainMixer(GrainAudioSource* s) : m_syn(s)
     {
         for (int i=0;i<(int)m_grains.size();++i)
         {
             m_grains[i].m_syn = s;
-            m_grains[i].setNumOutChans(1);
+            m_grains[i].setNumOutChans(m_grainChans);
         }
+        // every stream has at most one pending event, so the queue never has to grow
+        std::vector<GrainEvent> eventstorage;
+        eventstorage.reserve(MaxStreams);
+        m_events = std::priority_queue<GrainEvent>(std::less<GrainEvent>(),std::move(eventstorage));
+        // builds the pan tables now instead of on the audio thread when panning is first used
+        PanGainTable::get(2);
+        m_streams[0].enabled = true;
     }
     std::mt19937 m_randgen;
     std::normal_distribution<float> m_gaussdist{0.0f,1.0f};
+    std::uniform_real_distribution<float> m_unidist{0.0f,1.0f};
     int debugCounter = 0;
     int findFreeGain()
     {
-        for (int i=0;i<m_grains.size();++i)
+        for (int i=0;i<(int)m_grains.size();++i)
         {
             if (m_grains[i].playState==0)
                 return i;
@@ -180,54 +483,89 @@ public:
     float m_actLoopstart = 0.0f;
     float m_actLoopend = 1.0f;
     float m_actSourcePos = 0.0f;
-    void processAudio(float* buf)
+    // which voice of the source this is, for GrainAudioSource::noteVoiceRead
+    int m_voiceIndex = 0;
+    // Adds nframes of output into buf, grain channel i at buf[i*stride], or the
+    // PanGainTable::MaxOutputs outputs with panned grains. The grains due within the block
+    // are found once per block. Each starts at the sample it is due, the playing grains are
+    // mixed up to there first, so a grain that ends earlier in the block is free for it.
+    void processBlock(float* buf, int stride, int nframes)
     {
         if (m_inputdur<0.5f)
             return;
-        if (m_outcounter == m_nextGrainPos)
-        {
-            ++debugCounter;
-            m_outcounter = 0;
-            float glen = m_grainDensity*1.9;
-            float glensamples = m_sr*glen;
-            float posrand = m_gaussdist(m_randgen)*m_posrandamt*glensamples;
-            float srcpostouse = m_srcpos+posrand;
-            m_actSourcePos = srcpostouse+m_loopstart*m_inputdur;
-            int availgrain = findFreeGain();
-            if (availgrain>=0)
-            {
-                m_grains[availgrain].initGrain(m_inputdur,srcpostouse+m_loopstart*m_inputdur,glen,m_pitch);
-            }
-            m_nextGrainPos=m_sr*(m_grainDensity);
-            m_srcpos+=m_sr*(m_grainDensity)*m_sourcePlaySpeed;
-            float actlooplen = m_looplen;
-            float loopend = m_loopstart+actlooplen;
-            
-            if (loopend>1.0f)
+        for (int i=0;i<MaxStreams;++i)
+        {
+            if (m_streams[i].enabled && !m_streamPending[i])
             {
-                actlooplen-=loopend-1.0f;
+                m_streamPending[i] = true;
+                m_streamGrid[i] = m_clock;
+                m_events.push(GrainEvent(m_clock,i));
             }
-            if (m_srcpos>=actlooplen*m_inputdur)
-                m_srcpos = 0.0f;
-            else if (m_srcpos<0.0f)
-                m_srcpos = actlooplen*m_inputdur;
-            m_actLoopstart = m_loopstart;
-            m_actLoopend = m_loopstart+actlooplen;
-
         }
-        for (int i=0;i<(int)m_grains.size();++i)
+        float actlooplen = m_looplen;
+        float loopend = m_loopstart+actlooplen;
+        
+        if (loopend>1.0f)
         {
-            if (m_grains[i].playState==1)
+            actlooplen-=loopend-1.0f;
+        }
+        m_actLoopstart = m_loopstart;
+        m_actLoopend = m_loopstart+actlooplen;
+        const double looplensamples = actlooplen*m_inputdur;
+        const double srcinc = m_sourcePlaySpeed*m_sourceRateRatio;
+        int mixedframes = 0;
+        const double lastclock = m_clock+nframes-1;
+        while (!m_events.empty() && m_events.top().onset <= lastclock)
+        {
+            GrainEvent ev = m_events.top();
+            m_events.pop();
+            const GrainStream& stream = m_streams[ev.stream];
+            if (!stream.enabled)
             {
-                m_grains[i].process(buf);
+                m_streamPending[ev.stream] = false;
+                continue;
             }
+            // the first sample at or after the onset
+            int frame = std::max<int>(std::ceil(ev.onset-m_clock),0);
+            mixGrains(buf+mixedframes,stride,frame-mixedframes);
+            mixedframes = frame;
+            startGrain(std::min(m_clock+frame-ev.onset,0.999),
+                advanceSourcePos(m_srcpos,frame,srcinc,looplensamples));
+            m_events.push(GrainEvent(nextOnset(ev),ev.stream));
         }
-        ++m_outcounter;
+        mixGrains(buf+mixedframes,stride,nframes-mixedframes);
+        m_srcpos = advanceSourcePos(m_srcpos,nframes,srcinc,looplensamples);
+        m_clock += nframes;
     }
+    // One output frame, for callers that process a sample at a time
+    void processAudio(float* buf)
+    {
+        processBlock(buf,1,1);
+    }
+    // Panned output only uses the first grain channel. Changing the count stops the playing
+    // grains, nothing is reallocated so this can be called from the audio thread.
+    void setNumGrainChannels(int chans)
+    {
+        if (chans == m_grainChans)
+            return;
+        m_grainChans = chans;
+        for (int i=0;i<(int)m_grains.size();++i)
+            m_grains[i].setNumOutChans(chans);
+    }
+    int getNumGrainChannels() const { return m_grainChans; }
     float getSourcePlayPosition()
     {
         return m_srcpos+m_inputdur*m_loopstart;
     }
+    // Changes take effect from the stream's next grain
+    void setStream(int index, bool enabled, GrainStreamType type = GST_Synchronous, float rateMultiplier = 1.0f)
+    {
+        if (index<0 || index>=MaxStreams)
+            return;
+        m_streams[index].enabled = enabled;
+        m_streams[index].type = type;
+        m_streams[index].rateMultiplier = std::max(rateMultiplier,0.01f);
+    }
     double m_srcpos = 0.0;
     float m_sr = 44100.0;
     
@@ -235,20 +573,146 @@ public:
     float m_pitch = 0.0f; // semitones
     float m_posrandamt = 0.0f;
     float m_inputdur = 0.0f; // samples!
+    // source sample rate / m_sr, source positions are in source samples
+    float m_sourceRateRatio = 1.0f;
     float m_loopstart = 0.0f;
     float m_looplen = 1.0f;
-    int m_outcounter = 0;
-    int m_nextGrainPos = 0;
+    // 1 for mono, or 2, 4 or 8 for panned grains, in which case processAudio
+    // writes PanGainTable::MaxOutputs channels into the buffer
+    int m_numOutputs = 1;
+    float m_spread = 0.0f; // 0..1
+    // 0..1, random displacement of synchronous grains as a fraction of the grain interval
+    float m_jitter = 0.0f;
     
-    std::array<ISGrain,2> m_grains;
+    std::array<ISGrain,4> m_grains;
     void setDensity(float d)
     {
         if (d!=m_grainDensity)
         {
             m_grainDensity = d;
-            //m_nextGrainPos = m_outcounter;
         }
     }
 private:
+    // The play position after nframes steps of inc. A step that reaches the loop end goes
+    // to the loop start, one that goes before the start goes to the end. Only the steps
+    // that wrap are taken one at a time.
+    static double advanceSourcePos(double pos, int nframes, double inc, double looplen)
+    {
+        while (nframes>0)
+        {
+            if (pos+inc>=looplen)
+            {
+                pos = 0.0;
+                --nframes;
+                continue;
+            }
+            if (pos+inc<0.0)
+            {
+                pos = looplen;
+                --nframes;
+                continue;
+            }
+            // steps before the next wrap
+            double steps = nframes;
+            if (inc>0.0)
+                steps = std::ceil((looplen-pos)/inc)-1.0;
+            else if (inc<0.0)
+                steps = std::floor(pos/-inc);
+            if (steps>=nframes)
+                return pos+nframes*inc;
+            pos += steps*inc;
+            nframes -= steps;
+        }
+        return pos;
+    }
+    void mixGrains(float* buf, int stride, int nframes)
+    {
+        if (nframes<=0)
+            return;
+        if (m_numOutputs>1)
+        {
+            for (int i=0;i<(int)m_grains.size();++i)
+            {
+                if (m_grains[i].playState==1)
+                    m_grains[i].mixPanned(buf,stride,nframes);
+            }
+            return;
+        }
+        switch (m_grainChans)
+        {
+        case 1: mixGrains<1>(buf,stride,nframes); break;
+        case 2: mixGrains<2>(buf,stride,nframes); break;
+        case 4: mixGrains<4>(buf,stride,nframes); break;
+        default: mixGrains<0>(buf,stride,nframes);
+        }
+    }
+    template<int Chans>
+    void mixGrains(float* buf, int stride, int nframes)
+    {
+        for (int i=0;i<(int)m_grains.size();++i)
+        {
+            if (m_grains[i].playState==1)
+                m_grains[i].template mix<Chans>(buf,stride,nframes);
+        }
+    }
+    // srcpos is the play position within the loop at the grain's first sample
+    void startGrain(float onsetoffset, double srcpos)
+    {
+        ++debugCounter;
+        float glen = m_grainDensity*1.9;
+        float glensamples = m_sr*glen*m_sourceRateRatio;
+        float posrand = m_gaussdist(m_randgen)*m_posrandamt*glensamples;
+        float srcpostouse = srcpos+posrand;
+        m_actSourcePos = srcpostouse+m_loopstart*m_inputdur;
+        GrainReadRegion region;
+        region.position = srcpos+m_loopstart*m_inputdur;
+        // nearly all of the position randomization and the source frames a grain reads
+        float spread = 3.0f*m_posrandamt*glensamples;
+        region.start = region.position-spread;
+        region.end = region.position+spread+glensamples*std::pow(2.0f,m_pitch/12.0f);
+        region.framesPerSecond = m_sourcePlaySpeed*m_sourceRateRatio*m_sr;
+        region.loopStart = m_actLoopstart*m_inputdur;
+        region.loopEnd = m_actLoopend*m_inputdur;
+        m_syn->noteVoiceRead(m_voiceIndex,region);
+        int availgrain = findFreeGain();
+        if (availgrain>=0)
+        {
+            m_grains[availgrain].setSampleRate(m_sr);
+            m_grains[availgrain].initGrain(m_inputdur,srcpostouse+m_loopstart*m_inputdur,glen,m_pitch,
+                m_sourceRateRatio,onsetoffset);
+            if (m_numOutputs>1)
+            {
+                // stereo spreads from the center, the rings from between the first two outputs
+                float center = m_numOutputs == 2 ? 0.5f : 0.5f/m_numOutputs;
+                float panpos = center+(m_unidist(m_randgen)-0.5f)*m_spread;
+                if (m_numOutputs>2)
+                    panpos -= std::floor(panpos);
+                m_grains[availgrain].setPanGains(PanGainTable::get(m_numOutputs).getGains(panpos));
+            }
+        }
+    }
+    double nextOnset(const GrainEvent& ev)
+    {
+        const GrainStream& stream = m_streams[ev.stream];
+        double interval = m_sr*m_grainDensity/stream.rateMultiplier;
+        if (stream.type == GST_Asynchronous)
+        {
+            m_streamGrid[ev.stream] = ev.onset-std::log(1.0-m_unidist(m_randgen))*interval;
+            return m_streamGrid[ev.stream];
+        }
+        // jitter is relative to the regular grid, so it doesn't accumulate into drift.
+        // The grid restarts if it fell behind, like after the stream type changed.
+        if (m_streamGrid[ev.stream]+interval < ev.onset)
+            m_streamGrid[ev.stream] = ev.onset;
+        m_streamGrid[ev.stream] += interval;
+        double onset = m_streamGrid[ev.stream]+(m_unidist(m_randgen)-0.5f)*m_jitter*interval;
+        return std::max(onset,ev.onset);
+    }
     float m_grainDensity = 0.1;
+    std::array<GrainStream,MaxStreams> m_streams;
+    std::array<bool,MaxStreams> m_streamPending{};
+    std::array<double,MaxStreams> m_streamGrid{};
+    std::priority_queue<GrainEvent> m_events;
+    double m_clock = 0.0;
+    int m_grainChans = 1;
 };
@@ -0,0 +1,369 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "dr_wav.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Read only memory mapping of an uncompressed PCM or float WAV file. Frames are
+// converted to float on demand, so the file never has to be decoded into RAM.
+// Reading the mapping of a file that was truncated after it was opened faults, so
+// check isIntact before reading and don't read it from the audio thread at all.
+class MappedWavFile
+{
+public:
+    MappedWavFile() {}
+    ~MappedWavFile()
+    {
+        close();
+    }
+    MappedWavFile(const MappedWavFile&) = delete;
+    MappedWavFile& operator=(const MappedWavFile&) = delete;
+    // Returns false if the file can't be mapped or isn't in a format we can read directly
+    bool open(std::string filename)
+    {
+        close();
+        drwav wav;
+        if (!drwav_init_file(&wav, filename.c_str(), nullptr))
+            return false;
+        bool formatOk = false;
+        if (wav.translatedFormatTag == DR_WAVE_FORMAT_PCM)
+            formatOk = wav.bitsPerSample == 16 || wav.bitsPerSample == 24 || wav.bitsPerSample == 32;
+        if (wav.translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT)
+            formatOk = wav.bitsPerSample == 32;
+        m_channels = wav.channels;
+        m_sampleRate = wav.sampleRate;
+        m_numFrames = wav.totalPCMFrameCount;
+        m_bytesPerSample = wav.bitsPerSample/8;
+        m_isFloat = wav.translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT;
+        drwav_uint64 dataPos = wav.dataChunkDataPos;
+        drwav_uninit(&wav);
+        if (!formatOk || m_channels == 0 || m_numFrames == 0)
+            return false;
+        if (!mapFile(filename))
+            return false;
+        if (dataPos+m_numFrames*m_channels*m_bytesPerSample > m_mappedSize)
+        {
+            close();
+            return false;
+        }
+        m_data = m_mapped+dataPos;
+        return true;
+    }
+    void close()
+    {
+#ifdef _WIN32
+        if (m_mapped)
+            UnmapViewOfFile(m_mapped);
+        if (m_mapHandle)
+            CloseHandle(m_mapHandle);
+        if (m_fileHandle != INVALID_HANDLE_VALUE)
+            CloseHandle(m_fileHandle);
+        m_mapHandle = nullptr;
+        m_fileHandle = INVALID_HANDLE_VALUE;
+#else
+        if (m_mapped)
+            munmap(m_mapped,m_mappedSize);
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+#endif
+        m_mapped = nullptr;
+        m_data = nullptr;
+        m_mappedSize = 0;
+    }
+    unsigned int channels() const { return m_channels; }
+    unsigned int sampleRate() const { return m_sampleRate; }
+    drwav_uint64 size() const { return m_numFrames; }
+    // 32 bit float files that happen to be suitably aligned can be read as is
+    const float* floatData() const
+    {
+        if (m_isFloat && ((uintptr_t)m_data % alignof(float)) == 0)
+            return (const float*)m_data;
+        return nullptr;
+    }
+    // Same for 16 bit files
+    const int16_t* int16Data() const
+    {
+        if (!m_isFloat && m_bytesPerSample == 2 && ((uintptr_t)m_data % alignof(int16_t)) == 0)
+            return (const int16_t*)m_data;
+        return nullptr;
+    }
+    inline float getSample(drwav_uint64 frame, int chan) const
+    {
+        const unsigned char* p = m_data+(frame*m_channels+chan)*m_bytesPerSample;
+        if (m_isFloat)
+        {
+            float result;
+            memcpy(&result,p,sizeof(float));
+            return result;
+        }
+        if (m_bytesPerSample == 2)
+            return (int16_t)(p[0] | (p[1] << 8)) * (1.0f/32768.0f);
+        if (m_bytesPerSample == 3)
+            return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) * (1.0f/2147483648.0f);
+        return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24)
+            * (1.0f/2147483648.0f);
+    }
+    // False if the file has become shorter than the mapping since it was opened
+    bool isIntact() const
+    {
+        if (!m_mapped)
+            return false;
+#ifdef _WIN32
+        LARGE_INTEGER filesize;
+        return GetFileSizeEx(m_fileHandle,&filesize) && (size_t)filesize.QuadPart >= m_mappedSize;
+#else
+        struct stat st;
+        return fstat(m_fd,&st) == 0 && (size_t)st.st_size >= m_mappedSize;
+#endif
+    }
+    // Converts numFrames interleaved frames to floats, frames past the end are silent.
+    // Reads the mapping, so not to be called from the audio thread.
+    void readFrames(drwav_int64 startFrame, int numFrames, float* dest) const
+    {
+        drwav_int64 endFrame = std::min<drwav_int64>(startFrame+numFrames,m_numFrames);
+        int numvalid = std::max<drwav_int64>(endFrame-startFrame,0);
+        const float* floats = floatData();
+        if (floats)
+            std::copy(floats+startFrame*m_channels,floats+endFrame*m_channels,dest);
+        else
+        {
+            for (int i=0;i<numvalid;++i)
+                for (unsigned int j=0;j<m_channels;++j)
+                    dest[i*m_channels+j] = getSample(startFrame+i,j);
+        }
+        std::fill(dest+numvalid*m_channels,dest+numFrames*m_channels,0.0f);
+    }
+private:
+    bool mapFile(std::string filename)
+    {
+#ifdef _WIN32
+        int wlen = MultiByteToWideChar(CP_UTF8,0,filename.c_str(),-1,nullptr,0);
+        std::wstring wfilename(wlen,0);
+        MultiByteToWideChar(CP_UTF8,0,filename.c_str(),-1,&wfilename[0],wlen);
+        m_fileHandle = CreateFileW(wfilename.c_str(),GENERIC_READ,FILE_SHARE_READ,nullptr,
+            OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,nullptr);
+        if (m_fileHandle == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER filesize;
+        if (!GetFileSizeEx(m_fileHandle,&filesize))
+        {
+            close();
+            return false;
+        }
+        m_mapHandle = CreateFileMappingW(m_fileHandle,nullptr,PAGE_READONLY,0,0,nullptr);
+        if (!m_mapHandle)
+        {
+            close();
+            return false;
+        }
+        m_mapped = (unsigned char*)MapViewOfFile(m_mapHandle,FILE_MAP_READ,0,0,0);
+        if (!m_mapped)
+        {
+            close();
+            return false;
+        }
+        m_mappedSize = filesize.QuadPart;
+        return true;
+#else
+        // the descriptor is kept open for checking the file size later
+        m_fd = ::open(filename.c_str(),O_RDONLY);
+        if (m_fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(m_fd,&st) != 0 || st.st_size == 0)
+        {
+            close();
+            return false;
+        }
+        void* ptr = mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,m_fd,0);
+        if (ptr == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+        m_mapped = (unsigned char*)ptr;
+        m_mappedSize = st.st_size;
+        return true;
+#endif
+    }
+    unsigned char* m_mapped = nullptr;
+    const unsigned char* m_data = nullptr;
+    size_t m_mappedSize = 0;
+    unsigned int m_channels = 0;
+    unsigned int m_sampleRate = 0;
+    drwav_uint64 m_numFrames = 0;
+    int m_bytesPerSample = 0;
+    bool m_isFloat = false;
+#ifdef _WIN32
+    HANDLE m_fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE m_mapHandle = nullptr;
+#else
+    int m_fd = -1;
+#endif
+};
+
+// Decoded blocks of a MappedWavFile, so that the audio thread reads streamed files from
+// memory and never touches the mapping. A worker thread decides which blocks are resident
+// and loads them, the audio thread only reads and gets silence for the blocks that aren't.
+// The memory is bounded by MaxBytes whatever the size of the file.
+class MappedWavCache
+{
+public:
+    static const int BlockFrames = 8192;
+    static const size_t MaxBytes = 32*1024*1024;
+    MappedWavCache() {}
+    MappedWavCache(const MappedWavCache&) = delete;
+    MappedWavCache& operator=(const MappedWavCache&) = delete;
+    // Worker thread only. Drops the cached blocks and starts caching the file, nullptr
+    // releases the memory. The file must stay open until the cache is switched away from it.
+    void setFile(const MappedWavFile* file)
+    {
+        m_file.store(nullptr);
+        waitForReaders();
+        m_table.reset();
+        m_slotData = std::vector<float>();
+        m_slotBlocks.clear();
+        m_numBlocks = 0;
+        m_channels = 0;
+        if (file)
+        {
+            m_channels = file->channels();
+            m_numBlocks = (file->size()+BlockFrames-1)/BlockFrames;
+            m_table.reset(new std::atomic<int>[m_numBlocks]);
+            for (int i=0;i<m_numBlocks;++i)
+                m_table[i].store(-1);
+            size_t blockbytes = (size_t)BlockFrames*m_channels*sizeof(float);
+            int numslots = std::max<size_t>(MaxBytes/blockbytes,8);
+            numslots = std::min(numslots,m_numBlocks);
+            m_slotData.resize((size_t)numslots*BlockFrames*m_channels);
+            m_slotBlocks.assign(numslots,-1);
+        }
+        m_file.store(file);
+    }
+    const MappedWavFile* file() const { return m_file.load(); }
+    int numSlots() const { return m_slotBlocks.size(); }
+    int numBlocks() const { return m_numBlocks; }
+    // Worker thread only. Makes the blocks resident, in the order given, and evicts blocks
+    // that aren't in the list to make room. Blocks past the slot count are ignored.
+    // Returns the number of blocks loaded, stops early if the file has been truncated.
+    int update(const std::vector<int>& wanted)
+    {
+        const MappedWavFile* file = m_file.load();
+        if (!file)
+            return 0;
+        int numwanted = std::min<int>(wanted.size(),numSlots());
+        std::vector<bool> keep(numSlots(),false);
+        std::vector<int> missing;
+        for (int i=0;i<numwanted;++i)
+        {
+            int slot = m_table[wanted[i]].load();
+            if (slot >= 0)
+                keep[slot] = true;
+            else
+                missing.push_back(wanted[i]);
+        }
+        if (missing.empty())
+            return 0;
+        // unpublish the blocks to be replaced, then wait for reads that may still use them
+        std::vector<int> freeslots;
+        for (int i=0;i<numSlots() && freeslots.size()<missing.size();++i)
+        {
+            if (keep[i])
+                continue;
+            if (m_slotBlocks[i] >= 0)
+                m_table[m_slotBlocks[i]].store(-1);
+            m_slotBlocks[i] = -1;
+            freeslots.push_back(i);
+        }
+        waitForReaders();
+        int loaded = 0;
+        for (int i=0;i<(int)freeslots.size();++i)
+        {
+            if (!file->isIntact())
+                break;
+            int slot = freeslots[i];
+            int block = missing[i];
+            file->readFrames((drwav_int64)block*BlockFrames,BlockFrames,
+                &m_slotData[(size_t)slot*BlockFrames*m_channels]);
+            m_slotBlocks[slot] = block;
+            m_table[block].store(slot);
+            ++loaded;
+        }
+        return loaded;
+    }
+    // Audio thread. Reads frames of the file into dest with the channel mapping, the frames
+    // that aren't resident or are outside of the file are silent. Returns the number of
+    // frames within the file that weren't resident.
+    template<typename ChannelMap>
+    int read(const MappedWavFile* file, float* dest, int frames, int channels, drwav_int64 startFrame,
+        ChannelMap chanmap)
+    {
+        int missing = 0;
+        m_readers.fetch_add(1);
+        const bool current = file && m_file.load() == file;
+        int i = 0;
+        while (i<frames)
+        {
+            drwav_int64 frame = startFrame+i;
+            int block = frame >= 0 ? frame/BlockFrames : -1;
+            // up to the end of the block, or to the first frame inside the file
+            int run = frame >= 0 ? std::min<drwav_int64>(frames-i,(drwav_int64)(block+1)*BlockFrames-frame)
+                : std::min<drwav_int64>(frames-i,-frame);
+            int slot = -1;
+            if (current && block >= 0 && block < m_numBlocks)
+            {
+                slot = m_table[block].load();
+                if (slot < 0 && frame < (drwav_int64)file->size())
+                    missing += std::min<drwav_int64>(run,file->size()-frame);
+            }
+            if (slot >= 0)
+            {
+                const float* src = &m_slotData[((size_t)slot*BlockFrames+(frame-(drwav_int64)block*BlockFrames))*m_channels];
+                for (int k=0;k<run;++k)
+                    for (int j=0;j<channels;++j)
+                        dest[(i+k)*channels+j] = src[k*m_channels+chanmap(m_channels,j)];
+            } else
+            {
+                std::fill(dest+i*channels,dest+(i+run)*channels,0.0f);
+            }
+            i += run;
+        }
+        m_readers.fetch_sub(1);
+        return missing;
+    }
+private:
+    void waitForReaders()
+    {
+        while (m_readers.load() > 0)
+            std::this_thread::yield();
+    }
+    std::atomic<const MappedWavFile*> m_file{nullptr};
+    // reads in progress on the audio thread
+    std::atomic<int> m_readers{0};
+    // slot of each block of the file, -1 when not resident
+    std::unique_ptr<std::atomic<int>[]> m_table;
+    int m_numBlocks = 0;
+    unsigned int m_channels = 0;
+    std::vector<float> m_slotData;
+    // worker thread only, the block in each slot
+    std::vector<int> m_slotBlocks;
+};
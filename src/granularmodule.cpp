@@ -2,238 +2,122 @@
 #include "grain_engine/grain_engine.h"
 #define DR_WAV_IMPLEMENTATION
 #include "grain_engine/dr_wav.h"
+#include "grain_engine/drwav_source.h"
 #include "helperwidgets.h"
 #include <osdialog.h>
-#include <thread>
-#include <mutex>
 
-class DrWavBuffer
-{
-public:
-    DrWavBuffer() {}
-    DrWavBuffer(float* src, drwav_uint64 numFrames)
-    {
-        m_buf = src;
-        m_sz = numFrames;
-    }
-    ~DrWavBuffer()
-    {
-        if (m_buf)
-            drwav_free(m_buf, nullptr);
-    }
-    DrWavBuffer(const DrWavBuffer&) = delete;
-    DrWavBuffer& operator=(const DrWavBuffer&) = delete;
-    DrWavBuffer(DrWavBuffer&& other)
-    {
-        m_buf = other.m_buf;
-        m_sz = other.m_sz;
-        other.m_buf = nullptr;
-        other.m_sz = 0;
-    }
-    DrWavBuffer& operator=(DrWavBuffer&& other)
-    {
-        std::swap(m_buf,other.m_buf);
-        std::swap(m_sz,other.m_sz);
-        return *this;
-    }
-    float* data() { return m_buf; }
-    drwav_uint64 size() { return m_sz; }
-private:
-    float* m_buf = nullptr;
-    drwav_uint64 m_sz = 0;
-};
-
-class DrWavSource : public GrainAudioSource
+// Polyphonic grain voices, each with its own grain mixer state, all reading the same source.
+// Voices are only created once that many are used.
+class GrainEngine
 {
 public:
-    float* m_pSampleData = nullptr;
-    unsigned int m_channels = 0;
-    unsigned int m_sampleRate = 0;
-    drwav_uint64 m_totalPCMFrameCount = 0;
-    std::mutex m_mut;
-    void normalize(float level)
+    static const int MaxVoices = 16;
+    static const int BlockSize = 32;
+    GrainEngine() {}
+    // Creates the voices up to numvoices. Allocates, so call from the GUI thread.
+    // Voices the audio thread wants before they exist are silent.
+    void prepareVoices(int numvoices)
     {
-        if (!m_pSampleData)
-            return;
-        float peak = 0.0f;
-        for (int i=0;i<m_totalPCMFrameCount*m_channels;++i)
+        numvoices = clamp(numvoices,1,MaxVoices);
+        int created = m_numCreated.load();
+        for (int i=created;i<numvoices;++i)
         {
-            float s = std::fabs(m_pSampleData[i]);
-            peak = std::max(s,peak);
+            GrainMixer* voice = new GrainMixer(&m_src);
+            // voices shouldn't randomize in lockstep
+            voice->m_randgen.seed(i+1);
+            voice->m_voiceIndex = i;
+            m_voices[i].reset(voice);
         }
-        float normfactor = 1.0f;
-        if (peak>0.0f)
-            normfactor = level/peak;
-        for (int i=0;i<m_totalPCMFrameCount*m_channels;++i)
-            m_pSampleData[i]*=normfactor;
-        updatePeaks();
+        if (numvoices>created)
+            m_numCreated.store(numvoices);
     }
-    void reverse()
+    int getNumVoices() const { return m_numCreated.load(); }
+    // With 0 outputs the grains keep the source channels, otherwise they are mono
+    int getNumGrainChannels(int numoutputs)
     {
-        if (!m_pSampleData)
-            return;
-        for (int i=0;i<m_totalPCMFrameCount/2;i++)
-        {
-            int index=(m_totalPCMFrameCount-i-1);
-            if (index<0 || index>=m_totalPCMFrameCount) break;
-            for (int j=0;j<m_channels;j++)
-            {
-                std::swap(m_pSampleData[i*m_channels+j],m_pSampleData[index*m_channels+j]);
-            }
-        }
-        updatePeaks();
+        if (numoutputs == 0)
+            return clamp((int)m_src.m_channels,1,MaxVoices);
+        return 1;
     }
-    void updatePeaks()
+    // The parameter arrays have numvoices entries. outs has MaxVoices planes of BlockSize
+    // samples. With one output each voice is written into its own plane, with 0 outputs the
+    // grains keep the source channels and the voices are mixed into that many planes,
+    // otherwise the voices are mixed into numoutputs (2, 4 or 8) panned planes.
+    // Returns the number of planes written into outs.
+    int processBlock(float sr, int numvoices, int numoutputs, float* outs, const float* playrates,
+        const float* pitches, const float* loopstarts, const float* looplens, float posrand, 
+        float grate, float spread, float jitter)
     {
-        peaksData.resize(m_channels);
-        int samplesPerPeak = 128;
-        int numPeaks = m_totalPCMFrameCount/samplesPerPeak;
-        for (int i=0;i<m_channels;++i)
+        int created = m_numCreated.load();
+        for (int i=m_numConfigured;i<created;++i)
+            applyGrainTiming(*m_voices[i]);
+        m_numConfigured = created;
+        // the source state is the same for the whole batch
+        float inputdur = m_src.m_totalPCMFrameCount;
+        float srcrate = m_src.m_sampleRate;
+        float rateratio = srcrate > 0.0f ? srcrate/sr : 1.0f;
+        int grainchans = getNumGrainChannels(numoutputs);
+        int outchans = numvoices;
+        if (numoutputs == 0)
+            outchans = grainchans;
+        else if (numoutputs>1)
+            outchans = numoutputs;
+        // the panned grains are mixed into all of the pan table's outputs
+        int numplanes = numoutputs>1 ? PanGainTable::MaxOutputs : outchans;
+        std::fill(outs,outs+numplanes*BlockSize,0.0f);
+        for (int i=0;i<std::min(numvoices,created);++i)
         {
-            peaksData[i].resize(numPeaks);
+            GrainMixer& gm = *m_voices[i];
+            gm.m_sr = sr;
+            gm.m_inputdur = inputdur;
+            gm.m_sourceRateRatio = rateratio;
+            gm.m_loopstart = loopstarts[i];
+            gm.m_looplen = looplens[i];
+            gm.m_sourcePlaySpeed = playrates[i];
+            gm.m_pitch = pitches[i];
+            gm.m_posrandamt = posrand;
+            gm.setDensity(grate);
+            gm.m_numOutputs = numoutputs;
+            gm.m_spread = spread;
+            gm.m_jitter = jitter;
+            gm.setNumGrainChannels(grainchans);
+            gm.processBlock(numoutputs == 1 ? outs+i*BlockSize : outs,BlockSize,BlockSize);
         }
-        for (int i=0;i<m_channels;++i)
-        {
-            int sampleCounter = 0;
-            for (int j=0;j<numPeaks;++j)
-            {
-                float minsample = std::numeric_limits<float>::max();
-                float maxsample = std::numeric_limits<float>::min();
-                for (int k=0;k<samplesPerPeak;++k)
-                {
-                    int index = sampleCounter*m_channels+i;
-                    float sample = 0.0f;
-                    if (index<m_totalPCMFrameCount*m_channels)
-                        sample = m_pSampleData[index];
-                    minsample = std::min(minsample,sample);
-                    maxsample = std::max(maxsample,sample);
-                    ++sampleCounter;
-                }
-                peaksData[i][j].minpeak = minsample;
-                peaksData[i][j].maxpeak = maxsample;
-            }
-        } 
+        return outchans;
     }
-    bool importFile(std::string filename)
+    // index must be less than getNumVoices
+    GrainMixer& getVoice(int index)
     {
-        float* pSampleData = nullptr;
-        unsigned int channels = 0;
-        unsigned int sampleRate = 0;
-        drwav_uint64 totalPCMFrameCount = 0;
-        pSampleData = drwav_open_file_and_read_pcm_frames_f32(
-            filename.c_str(), 
-            &channels, 
-            &sampleRate, 
-            &totalPCMFrameCount, 
-            NULL);
-
-        if (pSampleData == NULL) {
-            std::cout << "could not open wav with dr wav\n";
-            return false;
-        }
-        float* oldData = m_pSampleData;
-        m_mut.lock();
-        
-            m_channels = channels;
-            m_sampleRate = sampleRate;
-            m_totalPCMFrameCount = totalPCMFrameCount;
-            m_pSampleData = pSampleData;
-
-        m_mut.unlock();
-        drwav_free(oldData,nullptr);
-        updatePeaks();  
-        
-        return true;
+        return *m_voices[index];
     }
-    struct SamplePeaks
+    enum GrainTiming
     {
-        float minpeak = 0.0f;
-        float maxpeak = 0.0f;
+        GT_Synchronous,
+        GT_Asynchronous,
+        GT_Layered, // synchronous and asynchronous streams at the same time
+        GT_Last
     };
-    std::vector<std::vector<SamplePeaks>> peaksData;
-    DrWavSource()
+    void setGrainTiming(int timing)
     {
-        
-#ifdef __APPLE__
-        std::string filename("/Users/teemu/AudioProjects/sourcesamples/db_guit01.wav");
-#else
-        std::string filename("C:\\MusicAudio\\sourcesamples\\windchimes_c1.wav");
-#endif
-        importFile(filename);
-    }
-    void putIntoBuffer(float* dest, int frames, int channels, int startInSource) override
-    {
-        std::lock_guard<std::mutex> locker(m_mut);
-        if (m_channels==0)
-        {
-            for (int i=0;i<frames*channels;++i)
-                dest[i]=0.0f;
+        if (timing == m_grainTiming)
             return;
-        }
-        const int srcchanmap[4][4]=
-        {
-            {0,0,0,0},
-            {0,1,0,1},
-            {0,1,2,0},
-            {0,1,2,3}
-        };
-        for (int i=0;i<frames;++i)
-        {
-            int index = i+startInSource;
-            if (index>=0 && index<m_totalPCMFrameCount)
-            {
-                for (int j=0;j<channels;++j)
-                {
-                    int actsrcchan = srcchanmap[m_channels-1][j];
-                    dest[i*channels+j] = m_pSampleData[index*m_channels+actsrcchan];
-                }
-            } else
-            {
-                for (int j=0;j<channels;++j)
-                {
-                    dest[i*channels+j] = 0.0f;
-                }
-            }
-        }
-    }
-    ~DrWavSource()
-    {
-        drwav_free(m_pSampleData,nullptr);
-    }
-    int getSourceNumChannels() override
-    {
-        return m_channels;
-    }
-};
-
-class GrainEngine
-{
-public:
-    GrainEngine()
-    {
-
-    }
-    void process(float sr,float* buf, float playrate, float pitch, 
-        float loopstart, float looplen, float posrand, float grate)
-    {
-        buf[0] = 0.0f;
-        buf[1] = 0.0f;
-        buf[2] = 0.0f;
-        buf[3] = 0.0f;
-        m_gm.m_sr = sr;
-        m_gm.m_inputdur = m_src.m_totalPCMFrameCount;
-        m_gm.m_loopstart = loopstart;
-        m_gm.m_looplen = looplen;
-        m_gm.m_sourcePlaySpeed = playrate;
-        m_gm.m_pitch = pitch;
-        m_gm.m_posrandamt = posrand;
-        m_gm.setDensity(grate);
-        m_gm.processAudio(buf);
+        m_grainTiming = timing;
+        for (int i=0;i<m_numConfigured;++i)
+            applyGrainTiming(*m_voices[i]);
     }
     DrWavSource m_src;
-    GrainMixer m_gm{&m_src};
 private:
-    
+    void applyGrainTiming(GrainMixer& voice)
+    {
+        voice.setStream(0,true,m_grainTiming == GT_Asynchronous ? GST_Asynchronous : GST_Synchronous);
+        voice.setStream(1,m_grainTiming == GT_Layered,GST_Asynchronous);
+    }
+    std::array<std::unique_ptr<GrainMixer>,MaxVoices> m_voices;
+    // written by prepareVoices after the voice is ready
+    std::atomic<int> m_numCreated{0};
+    // audio thread only, the voices that have the grain timing applied
+    int m_numConfigured = 0;
+    int m_grainTiming = GT_Synchronous;
 };
 
 class XGranularModule : public rack::Module
@@ -251,6 +135,8 @@ public:
         PAR_ATTN_LOOPSTART,
         PAR_ATTN_LOOPLEN,
         PAR_GRAINDENSITY,
+        PAR_SPREAD,
+        PAR_JITTER,
         PAR_LAST
     };
     enum OUTPUTS
@@ -281,15 +167,44 @@ public:
         configParam(PAR_ATTN_LOOPSTART,-1.0f,1.0f,0.0f,"Loop start CV ATTN");
         configParam(PAR_ATTN_LOOPLEN,-1.0f,1.0f,0.0f,"Loop len CV ATTN");
         configParam(PAR_GRAINDENSITY,0.0f,1.0f,0.25f,"Grain rate");
+        configParam(PAR_SPREAD,0.0f,1.0f,0.5f,"Grain spread");
+        configParam(PAR_JITTER,0.0f,1.0f,0.0f,"Grain timing jitter");
+        m_eng.m_src.setEngineSampleRate(APP->engine->getSampleRate());
+        // the widget creates any further voices once they are used
+        m_eng.prepareVoices(1);
+    }
+    void onSampleRateChange() override
+    {
+        m_eng.m_src.setEngineSampleRate(APP->engine->getSampleRate());
     }
     json_t* dataToJson() override
     {
         json_t* resultJ = json_object();
-        json_object_set(resultJ,"importedfile",json_string(m_currentFile.c_str()));
+        json_object_set(resultJ,"importedfile",json_string(m_eng.m_src.getFileName().c_str()));
+        json_object_set(resultJ,"streamlargefiles",json_boolean(m_eng.m_src.m_streamLargeFiles));
+        json_object_set(resultJ,"compactstorage",json_boolean(m_eng.m_src.m_compactStorage));
+        json_object_set(resultJ,"outputchannels",json_integer(m_numOutputs));
+        json_object_set(resultJ,"graintiming",json_integer(m_grainTiming));
         return resultJ;
     }
     void dataFromJson(json_t* root) override
     {
+        json_t* streamJ = json_object_get(root,"streamlargefiles");
+        if (streamJ)
+            m_eng.m_src.m_streamLargeFiles = json_is_true(streamJ);
+        json_t* outchansJ = json_object_get(root,"outputchannels");
+        if (outchansJ)
+        {
+            int outchans = json_integer_value(outchansJ);
+            if (outchans == 0 || outchans == 1 || outchans == 2 || outchans == 4 || outchans == 8)
+                m_numOutputs = outchans;
+        }
+        json_t* timingJ = json_object_get(root,"graintiming");
+        if (timingJ)
+            m_grainTiming = clamp((int)json_integer_value(timingJ),0,GrainEngine::GT_Last-1);
+        json_t* compactJ = json_object_get(root,"compactstorage");
+        if (compactJ)
+            m_eng.m_src.m_compactStorage = json_is_true(compactJ);
         json_t* filenameJ = json_object_get(root,"importedfile");
         if (filenameJ)
         {
@@ -301,38 +216,93 @@ public:
     {
         if (filename.size()==0)
             return;
-        if (m_eng.m_src.importFile(filename))
-        {
-            m_currentFile = filename;
-        }
+        m_eng.m_src.importFileAsync(filename);
     }
-    std::string m_currentFile;
-    void process(const ProcessArgs& args) override
+    // Cuts the buffer to the loop knob settings and resets the loop to cover the result
+    // once the trimmed buffer is playing
+    void trimToLoop()
     {
-        float buf[4] ={0.0f,0.0f,0.0f,0.0f};
-        float prate = params[PAR_PLAYRATE].getValue();
-        prate += inputs[IN_CV_PLAYRATE].getVoltage()*params[PAR_ATTN_PLAYRATE].getValue()/10.0f;
-        prate = clamp(prate,-2.0f,2.0f);
-        float pitch = params[PAR_PITCH].getValue();
-        pitch += inputs[IN_CV_PITCH].getVoltage()*12.0f;
-        pitch = clamp(pitch,-24.0f,24.0f);
         float loopstart = params[PAR_LOOPSTART].getValue();
-        loopstart += inputs[IN_CV_LOOPSTART].getVoltage()*params[PAR_ATTN_LOOPSTART].getValue()/10.0f;
-        loopstart = clamp(loopstart,0.0f,1.0f);
         float looplen = params[PAR_LOOPLEN].getValue();
-        looplen += inputs[IN_CV_LOOPLEN].getVoltage()*params[PAR_ATTN_LOOPLEN].getValue()/10.0f;
-        looplen = clamp(looplen,0.0f,1.0f);
+        m_eng.m_src.editBufferAsync([loopstart,looplen](const DrWavBuffer& b) 
+        { 
+            return DrWavSource::trim(b,loopstart,looplen); 
+        },[this]() { m_loopResetPending = true; });
+    }
+    void process(const ProcessArgs& args) override
+    {
+        if (m_blockPos == GrainEngine::BlockSize)
+        {
+            renderBlock(args.sampleRate);
+            m_blockPos = 0;
+        }
+        outputs[OUT_AUDIO].setChannels(m_outChans);
+        for (int c=0;c<m_outChans;++c)
+            outputs[OUT_AUDIO].setVoltage(m_outBlock[c][m_blockPos]*5.0f,c);
+        ++m_blockPos;
+    }
+    // The output is rendered in blocks, with the parameters updated once per block
+    void renderBlock(float sampleRate)
+    {
+        if (m_loopResetPending.load() && m_loopResetPending.exchange(false))
+        {
+            params[PAR_LOOPSTART].setValue(0.0f);
+            params[PAR_LOOPLEN].setValue(1.0f);
+        }
+        // the voice count follows the widest of the CV inputs
+        int numvoices = 1;
+        for (int i=0;i<IN_LAST;++i)
+            numvoices = std::max(numvoices,inputs[i].getChannels());
+        // the knob and CV math is done for 4 voices at a time
+        alignas(16) float prates[GrainEngine::MaxVoices];
+        alignas(16) float pitches[GrainEngine::MaxVoices];
+        alignas(16) float loopstarts[GrainEngine::MaxVoices];
+        alignas(16) float looplens[GrainEngine::MaxVoices];
+        for (int c=0;c<numvoices;c+=4)
+        {
+            simd::float_4 prate = params[PAR_PLAYRATE].getValue();
+            prate += inputs[IN_CV_PLAYRATE].getPolyVoltageSimd<simd::float_4>(c)*params[PAR_ATTN_PLAYRATE].getValue()/10.0f;
+            prate = simd::clamp(prate,-2.0f,2.0f);
+            prate.store(prates+c);
+            simd::float_4 pitch = params[PAR_PITCH].getValue();
+            pitch += inputs[IN_CV_PITCH].getPolyVoltageSimd<simd::float_4>(c)*12.0f;
+            pitch = simd::clamp(pitch,-24.0f,24.0f);
+            pitch.store(pitches+c);
+            simd::float_4 loopstart = params[PAR_LOOPSTART].getValue();
+            loopstart += inputs[IN_CV_LOOPSTART].getPolyVoltageSimd<simd::float_4>(c)*params[PAR_ATTN_LOOPSTART].getValue()/10.0f;
+            loopstart = simd::clamp(loopstart,0.0f,1.0f);
+            loopstart.store(loopstarts+c);
+            simd::float_4 looplen = params[PAR_LOOPLEN].getValue();
+            looplen += inputs[IN_CV_LOOPLEN].getPolyVoltageSimd<simd::float_4>(c)*params[PAR_ATTN_LOOPLEN].getValue()/10.0f;
+            looplen = simd::clamp(looplen,0.0f,1.0f);
+            looplen.store(looplens+c);
+        }
         float posrnd = params[PAR_SRCPOSRANDOM].getValue();
         float grate = params[PAR_GRAINDENSITY].getValue();
         grate = 0.01f+std::pow(grate,2.0f)*0.49;
-        m_eng.process(args.sampleRate, buf,prate,pitch,loopstart,looplen,posrnd,grate);
-        outputs[OUT_AUDIO].setVoltage(buf[0]*5.0f);
-        graindebugcounter = m_eng.m_gm.debugCounter;
+        float spread = params[PAR_SPREAD].getValue();
+        float jitter = params[PAR_JITTER].getValue();
+        int numoutputs = m_numOutputs;
+        m_eng.setGrainTiming(m_grainTiming);
+        m_outChans = m_eng.processBlock(sampleRate,numvoices,numoutputs,&m_outBlock[0][0],prates,pitches,
+            loopstarts,looplens,posrnd,grate,spread,jitter);
+        if (m_eng.getNumVoices()>0)
+            graindebugcounter = m_eng.getVoice(0).debugCounter;
+        m_numVoices = numvoices;
     }
     int graindebugcounter = 0;
+    std::atomic<int> m_numVoices{1};
+    // 0 : voices mixed into the source's channels, 1 : polyphonic output with a channel per voice,
+    // 2/4/8 : voices panned into that many channels
+    std::atomic<int> m_numOutputs{1};
+    std::atomic<int> m_grainTiming{GrainEngine::GT_Synchronous};
+    // set by the edit thread when a trim has finished
+    std::atomic<bool> m_loopResetPending{false};
     GrainEngine m_eng;
 private:
-    
+    float m_outBlock[GrainEngine::MaxVoices][GrainEngine::BlockSize] = {};
+    int m_blockPos = GrainEngine::BlockSize;
+    int m_outChans = 1;
 };
 
 struct LoadFileItem : MenuItem
@@ -363,10 +333,46 @@ public:
 		auto loadItem = createMenuItem<LoadFileItem>("Import .wav file...");
 		loadItem->m_mod = m_gm;
 		menu->addChild(loadItem);
-        auto normItem = createMenuItem([this](){  m_gm->m_eng.m_src.normalize(1.0f); },"Normalize buffer");
+        auto normItem = createMenuItem([this](){  m_gm->m_eng.m_src.editBufferAsync(
+            [](const DrWavBuffer& b) { return DrWavSource::normalize(b,1.0f); }); },"Normalize buffer");
         menu->addChild(normItem);
-        auto revItem = createMenuItem([this](){  m_gm->m_eng.m_src.reverse(); },"Reverse buffer");
+        auto revItem = createMenuItem([this](){  m_gm->m_eng.m_src.editBufferAsync(
+            [](const DrWavBuffer& b) { return DrWavSource::reverse(b); }); },"Reverse buffer");
         menu->addChild(revItem);
+        auto dcItem = createMenuItem([this](){  m_gm->m_eng.m_src.editBufferAsync(
+            [](const DrWavBuffer& b) { return DrWavSource::removeDC(b); }); },"Remove DC offset");
+        menu->addChild(dcItem);
+        auto fadeItem = createMenuItem([this](){  m_gm->m_eng.m_src.editBufferAsync(
+            [](const DrWavBuffer& b) { return DrWavSource::fadeInOut(b,0.01f); }); },"Fade in and out");
+        menu->addChild(fadeItem);
+        auto trimItem = createMenuItem([this](){  m_gm->trimToLoop(); },"Trim buffer to loop");
+        menu->addChild(trimItem);
+        bool streaming = m_gm->m_eng.m_src.m_streamLargeFiles;
+        auto streamItem = createMenuItem([this,streaming](){  m_gm->m_eng.m_src.m_streamLargeFiles = !streaming; },
+            "Stream large files from disk",CHECKMARK(streaming));
+        menu->addChild(streamItem);
+        bool compact = m_gm->m_eng.m_src.m_compactStorage;
+        auto compactItem = createMenuItem([this,compact](){  m_gm->m_eng.m_src.m_compactStorage = !compact; },
+            "Store samples as 16 bit (next import)",CHECKMARK(compact));
+        menu->addChild(compactItem);
+        const int outchanopts[5] = {1,0,2,4,8};
+        const char* outchannames[5] = {"Output : channel per voice","Output : source channels","Output : stereo",
+            "Output : quad","Output : 8 channels"};
+        for (int i=0;i<5;++i)
+        {
+            int outchans = outchanopts[i];
+            auto outItem = createMenuItem([this,outchans](){  m_gm->m_numOutputs = outchans; },
+                outchannames[i],CHECKMARK(m_gm->m_numOutputs == outchans));
+            menu->addChild(outItem);
+        }
+        const char* timingnames[GrainEngine::GT_Last] = 
+            {"Grain timing : synchronous","Grain timing : asynchronous","Grain timing : layered"};
+        for (int i=0;i<GrainEngine::GT_Last;++i)
+        {
+            auto timingItem = createMenuItem([this,i](){  m_gm->m_grainTiming = i; },
+                timingnames[i],CHECKMARK(m_gm->m_grainTiming == i));
+            menu->addChild(timingItem);
+        }
     }
     XGranularWidget(XGranularModule* m)
     {
@@ -388,6 +394,17 @@ public:
             XGranularModule::PAR_LOOPLEN,XGranularModule::IN_CV_LOOPLEN,XGranularModule::PAR_ATTN_LOOPLEN,82,101));
         addChild(new KnobInAttnWidget(this,"SOURCE POS RAND",XGranularModule::PAR_SRCPOSRANDOM,-1,-1,1,142));
         addChild(new KnobInAttnWidget(this,"GRAIN RATE",XGranularModule::PAR_GRAINDENSITY,-1,-1,82,142));
+        addChild(new KnobInAttnWidget(this,"JITTER",XGranularModule::PAR_JITTER,-1,-1,1,183));
+        addChild(new KnobInAttnWidget(this,"SPREAD",XGranularModule::PAR_SPREAD,-1,-1,82,183));
+    }
+    void step() override
+    {
+        if (m_gm)
+        {
+            m_gm->m_eng.m_src.collectGarbage();
+            m_gm->m_eng.prepareVoices(m_gm->m_numVoices);
+        }
+        ModuleWidget::step();
     }
     void draw(const DrawArgs &args) override
     {
@@ -405,25 +422,51 @@ public:
             nvgTextLetterSpacing(args.vg, -1);
             nvgFillColor(args.vg, nvgRGBA(0xff, 0xff, 0xff, 0xff));
             
-            nvgText(args.vg, 1 , 230, buf, NULL);
+            nvgText(args.vg, box.size.x-40 , 230, buf, NULL);
+            m_gm->m_eng.m_src.markVisible();
+            if (m_gm->m_eng.m_src.isQueued())
+                nvgText(args.vg, 1 , 245, "Queued for loading...", NULL);
+            else if (m_gm->m_eng.m_src.isLoading())
+            {
+                sprintf(buf,"Loading... %d%%",(int)(m_gm->m_eng.m_src.getLoadProgress()*100.0f));
+                nvgText(args.vg, 1 , 245, buf, NULL);
+            } else if (m_gm->m_eng.m_src.isEditing())
+                nvgText(args.vg, 1 , 245, "Processing...", NULL);
+            else
+            {
+                std::string error = m_gm->m_eng.m_src.getLastError();
+                if (!error.empty())
+                    nvgText(args.vg, 1 , 245, error.c_str(), NULL);
+            }
 
             nvgStrokeColor(args.vg,nvgRGBA(0xff, 0xff, 0xff, 0xff));
             auto& src = m_gm->m_eng.m_src;
-            int numpeaks = box.size.x - 2;
-            int numchans = src.m_channels;
-            float numsrcpeaks = src.peaksData[0].size();
+            std::lock_guard<std::mutex> locker(src.m_peaksMut);
+            const PeakPyramid& peaks = src.m_peaks;
+            int numpixels = box.size.x - 2;
+            int numchans = peaks.numChannels;
+            int level = peaks.getLevelForWidth(numpixels);
+            int numsrcpeaks = peaks.getNumPeaks(level);
             float chanh = 100.0/numchans;
             nvgBeginPath(args.vg);
             for (int i=0;i<numchans;++i)
             {
-                for (int j=0;j<numpeaks;++j)
+                auto& chanpeaks = peaks.levels[level][i];
+                for (int j=0;j<numpixels;++j)
                 {
-                    float index = rescale(j,0,numpeaks,0.0f,numsrcpeaks-1.0f);
-                    if (index<numsrcpeaks)
+                    // fewer than LevelFactor peaks per pixel, see PeakPyramid
+                    int index0 = (int64_t)j*numsrcpeaks/numpixels;
+                    int index1 = std::max<int>((int64_t)(j+1)*numsrcpeaks/numpixels,index0+1);
+                    if (index0<numsrcpeaks)
                     {
-                        int index_i = index;
-                        float minp = src.peaksData[i][index_i].minpeak;
-                        float maxp = src.peaksData[i][index_i].maxpeak;
+                        index1 = std::min(index1,numsrcpeaks);
+                        float minp = chanpeaks[index0].minpeak;
+                        float maxp = chanpeaks[index0].maxpeak;
+                        for (int k=index0+1;k<index1;++k)
+                        {
+                            minp = std::min(minp,chanpeaks[k].minpeak);
+                            maxp = std::max(maxp,chanpeaks[k].maxpeak);
+                        }
                         float ycor0 = rescale(minp,-1.0f,1.0,0.0f,chanh);
                         float ycor1 = rescale(maxp,-1.0f,1.0,0.0f,chanh);
                         nvgMoveTo(args.vg,j,250.0+chanh*i+ycor0);
@@ -435,19 +478,24 @@ public:
             nvgStroke(args.vg);
             nvgBeginPath(args.vg);
             nvgFillColor(args.vg, nvgRGBA(0x00, 0xff, 0x00, 0x80));
-            float loopstart = m_gm->m_eng.m_gm.m_actLoopstart;
-            float loopend = m_gm->m_eng.m_gm.m_actLoopend;
+            // loop of the first voice and the play positions of all of them
+            int numvoices = std::min<int>(m_gm->m_numVoices,m_gm->m_eng.getNumVoices());
+            float loopstart = m_gm->m_eng.getVoice(0).m_actLoopstart;
+            float loopend = m_gm->m_eng.getVoice(0).m_actLoopend;
             float loopw = rescale(loopend-loopstart,0.0f,1.0f,0.0f,box.size.x-2.0f);
             float xcor = rescale(loopstart,0.0f,1.0f,0.0f,box.size.x-2.0f);
             nvgRect(args.vg,xcor,250.0f,loopw,100.0f);
             nvgFill(args.vg);
             nvgBeginPath(args.vg);
             nvgStrokeColor(args.vg,nvgRGBA(0xff, 0xff, 0xff, 0xff));
-            float ppos = m_gm->m_eng.m_gm.m_actSourcePos;
-            float srcdur = m_gm->m_eng.m_gm.m_inputdur;
-            xcor = rescale(ppos,0.0f,srcdur,0.0f,box.size.x-2.0f);
-            nvgMoveTo(args.vg,xcor,250.0f);
-            nvgLineTo(args.vg,xcor,250.0+100.0f);
+            for (int i=0;i<numvoices;++i)
+            {
+                float ppos = m_gm->m_eng.getVoice(i).m_actSourcePos;
+                float srcdur = m_gm->m_eng.getVoice(i).m_inputdur;
+                xcor = rescale(ppos,0.0f,srcdur,0.0f,box.size.x-2.0f);
+                nvgMoveTo(args.vg,xcor,250.0f);
+                nvgLineTo(args.vg,xcor,250.0+100.0f);
+            }
             nvgStroke(args.vg);
         }
         
@@ -486,6 +486,16 @@ public:
             }
         }    
     }
+    bool acquireSourceSpan(GrainSourceSpan& span) override
+    {
+        int outchanstouse = getNumOutputChannels();
+        if (m_BufferReady == false || outchanstouse == 0 || m_numOutputSamples == 0)
+            return false;
+        span.data = m_renderBuf.data();
+        span.numFrames = std::min<int>(m_numOutputSamples,m_renderBuf.size()/outchanstouse);
+        span.numChannels = outchanstouse;
+        return true;
+    }
 private:
     std::vector<float> m_renderBuf;
     std::chrono::steady_clock::time_point m_lastSetDirty;
@@ -1,31 +1,106 @@
 #include "plugin.hpp"
 #include "helperwidgets.h"
 #include <random>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
 
+// Zero order hold of 4 channels, each with its own rate. In the band limited mode a new value
+// is held from the fractional position where the phase wrapped, with the input interpolated
+// there, and the step to it is smoothed with a minBLEP residual.
 class SampleRateReducer
 {
 public:
-    float process(float insample)
+    SampleRateReducer()
     {
-        phase+=1.0;
-        if (phase>=divlen)
+        for (int i=0;i<BlepLength;++i)
+            blepbuf[i] = 0.0f;
+    }
+    simd::float_4 process(simd::float_4 insample)
+    {
+        phase+=1.0f;
+        simd::float_4 mask = phase>=divlen;
+        phase -= simd::ifelse(mask,divlen,0.0f);
+        if (!bandLimited)
         {
-            phase -= divlen;
-            heldsample = insample;
+            heldsample = simd::ifelse(mask,insample,heldsample);
+            prevsample = insample;
+            return heldsample;
         }
-        return heldsample;
-        
+        // how many samples ago the phase wrapped, normally below 1
+        simd::float_4 ago = simd::fmin(phase,0.999f);
+        simd::float_4 newsample = insample+(prevsample-insample)*ago;
+        prevsample = insample;
+        // lanes that aren't reduced just pass the input through
+        simd::float_4 steps = mask & (divlen>1.0f);
+        if (simd::movemask(steps))
+            insertSteps(ago,steps & (newsample-heldsample));
+        heldsample = simd::ifelse(mask,newsample,heldsample);
+        simd::float_4 residual = blepbuf[blepPos];
+        blepbuf[blepPos] = 0.0f;
+        blepPos = (blepPos+1) & (BlepLength-1);
+        return heldsample+residual;
     }
-    void setRates(float inrate, float outrate)
+    void setRates(float inrate, simd::float_4 outrate)
     {
-        if (outrate>inrate)
-            outrate = inrate;
+        outrate = simd::fmin(outrate,inrate);
         divlen = inrate/outrate;
     }
+    // The steps still pending from the band limited mode would be added after switching
+    // back to it, so they are dropped
+    void setBandLimited(bool b)
+    {
+        if (b == bandLimited)
+            return;
+        bandLimited = b;
+        for (int i=0;i<BlepLength;++i)
+            blepbuf[i] = 0.0f;
+        blepPos = 0;
+    }
 private:
-    float heldsample = 0.0f;
-    double phase = 0.0;
-    double divlen = 1.0;
+    static const int BlepZeroCrossings = 16;
+    static const int BlepOversampling = 16;
+    static const int BlepLength = 2*BlepZeroCrossings;
+    static const float* getBlepImpulse()
+    {
+        static std::vector<float> impulse = []()
+        {
+            std::vector<float> result(BlepLength*BlepOversampling+1);
+            dsp::minBlepImpulse(BlepZeroCrossings,BlepOversampling,result.data());
+            result.back() = 1.0f;
+            return result;
+        }();
+        return impulse.data();
+    }
+    // Like dsp::MinBlepGenerator, but the steps of all lanes are added in one go, each lane with 
+    // its own position
+    void insertSteps(simd::float_4 ago, simd::float_4 jump)
+    {
+        alignas(16) float positions[4];
+        (ago*BlepOversampling).store(positions);
+        alignas(16) float values[4];
+        for (int i=0;i<BlepLength;++i)
+        {
+            for (int j=0;j<4;++j)
+            {
+                float pos = positions[j]+i*BlepOversampling;
+                int index = pos;
+                float frac = pos-index;
+                values[j] = blepImpulse[index]+(blepImpulse[index+1]-blepImpulse[index])*frac;
+            }
+            simd::float_4 value = simd::float_4::load(values);
+            blepbuf[(blepPos+i) & (BlepLength-1)] += jump*(value-1.0f);
+        }
+    }
+    simd::float_4 heldsample = 0.0f;
+    simd::float_4 phase = 0.0f;
+    simd::float_4 divlen = 1.0f;
+    bool bandLimited = false;
+    simd::float_4 prevsample = 0.0f;
+    const float* blepImpulse = getBlepImpulse();
+    simd::float_4 blepbuf[BlepLength];
+    int blepPos = 0;
 };
 
 class GlitchGenerator
@@ -150,26 +225,26 @@ private:
     int m_repeatLen = 0;
 };
 
-inline float sin_dist(float in)
+inline simd::float_4 soft_clip(simd::float_4 x)
 {
-    return std::sin(3.141592653*2*in);
+    x = simd::clamp(x,-1.0f,1.0f);
+    return x-x*x*x*(1.0f/3.0f);
 }
 
-inline float sign(float in)
+inline simd::float_4 sin_dist(simd::float_4 in)
 {
-    if (in<0.0f)
-        return -1.0f;
-    return 1.0f;
+    return simd::sin(3.141592653f*2*in);
 }
 
-inline float sym_reflect(float in)
+inline simd::float_4 sym_reflect(simd::float_4 in)
 {
-    return sign(in)*2.0f*std::fabs(in/2.0f-std::round(in/2.0f));
+    simd::float_4 sign = simd::ifelse(in<0.0f,-1.0f,1.0f);
+    return sign*2.0f*simd::fabs(in/2.0f-simd::round(in/2.0f));
 }
 
-inline float sym_wrap(float in)
+inline simd::float_4 sym_wrap(simd::float_4 in)
 {
-    return 2.0f*(in/2.0f-std::round(in/2.0f));
+    return 2.0f*(in/2.0f-simd::round(in/2.0f));
 }
 
 struct RandShaper
@@ -190,56 +265,235 @@ struct RandShaper
         index = clamp(index,0,m_shapefunc.size()-1);
         return m_shapefunc[index];    
     }
+    inline simd::float_4 process(simd::float_4 in)
+    {
+        simd::float_4 result;
+        for (int i=0;i<4;++i)
+            result[i] = process(in[i]);
+        return result;
+    }
 };
 
-inline float distort(float in, float th, float type, RandShaper& rshaper)
+enum DistortionShapers
 {
-    int index0 = std::floor(type);
-    int index1 = index0+1;
-    float frac = type-index0;
-    float distsamples[7];
-    if (index0 == 0)
+    DS_SoftClip,
+    DS_Clip,
+    DS_Reflect,
+    DS_Wrap,
+    DS_Sine,
+    DS_Random,
+    DS_Last
+};
+
+inline simd::float_4 shaper(int index, simd::float_4 in, float th, RandShaper& rshaper)
+{
+    if (index == DS_SoftClip)
+        return soft_clip(in);
+    if (index == DS_Clip)
+        return simd::clamp(in,-th,th);
+    if (index == DS_Reflect)
+        return sym_reflect(in);
+    if (index == DS_Wrap)
+        return sym_wrap(in);
+    if (index == DS_Sine)
+        return sin_dist(in);
+    return rshaper.process(in);
+}
+
+// The shapers tabulated over -32..32, together with their antiderivatives. The shapers are
+// treated as piecewise linear between the table points and the antiderivatives are the exact
+// integrals of that, so the anti-aliased output is consistent with the plain one. Reflect, wrap
+// and sine are periodic, so their inputs are folded into the table range, the others are
+// constant outside of it. The tables are shared by all instances.
+class ShaperTables
+{
+public:
+    // a multiple of the random shaper steps per unit, so that its steps fall on table points
+    static const int PointsPerUnit = 252;
+    static const int Range = 32;
+    static const int TableSize = 2*Range*PointsPerUnit+1;
+    static const ShaperTables& get()
     {
-        distsamples[0] = soft_clip(in);
-        distsamples[1] = clamp(in,-th,th);
+        static ShaperTables tables;
+        return tables;
     }
-    else if (index0 == 1)
+    // NaN and infinite inputs are shaped as 0
+    static simd::float_4 finiteOrZero(simd::float_4 in)
     {
-        distsamples[1] = clamp(in,-th,th);
-        distsamples[2] = sym_reflect(in);
+        return simd::ifelse(simd::fabs(in)<=1.0e30f,in,0.0f);
     }
-    else if (index0 == 2)
+    // Morphs between the shapers at floor(type) and the one after it
+    simd::float_4 process(simd::float_4 in, simd::float_4 type) const
     {
-        distsamples[2] = sym_reflect(in);
-        distsamples[3] = sym_wrap(in);
+        in = finiteOrZero(in);
+        Lookup lu;
+        gather<false>(lu,in,type);
+        simd::float_4 v0 = lu.a[0]+(lu.b[0]-lu.a[0])*lu.t[0];
+        simd::float_4 v1 = lu.a[1]+(lu.b[1]-lu.a[1])*lu.t[1];
+        return v0+(v1-v0)*lu.frac;
     }
-    else if (index0 == 3)
+    // Antiderivative of the morphed shaper. The part that comes from the inputs being outside of 
+    // the table range is returned separately, so that differences of nearby antiderivatives 
+    // don't lose precision.
+    simd::float_4 antiderivative(simd::float_4 in, simd::float_4 type, simd::float_4& offset) const
     {
-        distsamples[3] = sym_wrap(in);
-        //distsamples[3] = wrap_value(-th,in,th);
-        if (frac>0.0f) 
-            distsamples[4] = sin_dist(in);
-        else
-            distsamples[4] = distsamples[3];
-    } 
-    else if (index0 == 4)
+        in = finiteOrZero(in);
+        Lookup lu;
+        gather<true>(lu,in,type);
+        const float step = 1.0f/PointsPerUnit;
+        simd::float_4 outside = in-simd::clamp(in,(float)-Range,(float)Range);
+        simd::float_4 ad[2];
+        simd::float_4 offs[2];
+        for (int i=0;i<2;++i)
+        {
+            simd::float_4 slope = lu.b[i]-lu.a[i];
+            ad[i] = lu.c[i]+lu.t[i]*step*(lu.a[i]+0.5f*slope*lu.t[i]);
+            offs[i] = lu.g[i]*simd::fabs(lu.periods)+lu.e[i]*(lu.a[i]+slope*lu.t[i])*outside;
+        }
+        offset = offs[0]+(offs[1]-offs[0])*lu.frac;
+        return ad[0]+(ad[1]-ad[0])*lu.frac;
+    }
+private:
+    ShaperTables()
     {
-        distsamples[4] = sin_dist(in);
-        if (frac>0.0f)
-            distsamples[5] = rshaper.process(in);
-        else
-            distsamples[5] = distsamples[4];
+        RandShaper rshaper;
+        m_points.resize(DS_Last*TableSize);
+        for (int i=0;i<DS_Last;++i)
+        {
+            Point* table = &m_points[i*TableSize];
+            for (int j=0;j<TableSize;++j)
+            {
+                float x = (float)(j-Range*PointsPerUnit)/PointsPerUnit;
+                table[j].y = shaper(i,x,1.0f,rshaper)[0];
+            }
+            // trapezoidal integral from 0, which is exact for the piecewise linear shaper
+            const int mid = Range*PointsPerUnit;
+            double sum = 0.0;
+            table[mid].ad = 0.0f;
+            for (int j=mid+1;j<TableSize;++j)
+            {
+                sum += 0.5*(table[j-1].y+table[j].y)/PointsPerUnit;
+                table[j].ad = sum;
+            }
+            sum = 0.0;
+            for (int j=mid-1;j>=0;--j)
+            {
+                sum -= 0.5*(table[j+1].y+table[j].y)/PointsPerUnit;
+                table[j].ad = sum;
+            }
+            m_periodic[i] = i == DS_Reflect || i == DS_Wrap || i == DS_Sine;
+            // how much the antiderivative grows over the table range, the same in both directions
+            // for the odd shapers
+            m_growth[i] = m_periodic[i] ? table[TableSize-1].ad : 0.0f;
+        }
     }
-    else if (index0 == 5)
+    struct Point
     {
-        distsamples[5] = rshaper.process(in);
-        distsamples[6] = distsamples[5];
+        float y;
+        float ad;
+    };
+    // Table values around the inputs for the pair of shapers each lane morphs between
+    struct Lookup
+    {
+        // values at the table points before and after the inputs, the positions between them 
+        // and the antiderivatives at the points before
+        simd::float_4 a[2], b[2], t[2], c[2];
+        // antiderivative growth per table range for the periodic shapers
+        simd::float_4 g[2];
+        // 1 for the shapers that continue with the edge value outside of the table range
+        simd::float_4 e[2];
+        simd::float_4 frac;
+        simd::float_4 periods;
+    };
+    template<bool WithAntiderivative>
+    void gather(Lookup& lu, simd::float_4 in, simd::float_4 type) const
+    {
+        simd::float_4 index0f = simd::floor(type);
+        lu.frac = type-index0f;
+        lu.periods = simd::trunc(in*(1.0f/Range));
+        // table positions for the shapers that are clamped and for the periodic ones
+        simd::float_4 pos[2];
+        pos[0] = (simd::clamp(in,(float)-Range,(float)Range)+Range)*PointsPerUnit;
+        pos[1] = (in-lu.periods*Range+Range)*PointsPerUnit;
+        alignas(16) float positions[2][4];
+        alignas(16) float shapers[4];
+        pos[0].store(positions[0]);
+        pos[1].store(positions[1]);
+        index0f.store(shapers);
+        alignas(16) float values[6][2][4];
+        for (int i=0;i<4;++i)
+        {
+            int shaper = shapers[i];
+            for (int j=0;j<2;++j)
+            {
+                int periodic = m_periodic[shaper];
+                // huge inputs lose the precision to fold them into the table range
+                float position = std::max(0.0f,std::min(positions[periodic][i],(float)(TableSize-1)));
+                int index = std::min((int)position,TableSize-2);
+                const Point* p = &m_points[shaper*TableSize+index];
+                values[0][j][i] = p[0].y;
+                values[1][j][i] = p[1].y;
+                values[2][j][i] = position-index;
+                if (WithAntiderivative)
+                {
+                    values[3][j][i] = p[0].ad;
+                    values[4][j][i] = m_growth[shaper];
+                    values[5][j][i] = 1-periodic;
+                }
+                shaper = std::min(shaper+1,DS_Last-1);
+            }
+        }
+        for (int j=0;j<2;++j)
+        {
+            lu.a[j] = simd::float_4::load(values[0][j]);
+            lu.b[j] = simd::float_4::load(values[1][j]);
+            lu.t[j] = simd::float_4::load(values[2][j]);
+            if (WithAntiderivative)
+            {
+                lu.c[j] = simd::float_4::load(values[3][j]);
+                lu.g[j] = simd::float_4::load(values[4][j]);
+                lu.e[j] = simd::float_4::load(values[5][j]);
+            }
+        }
     }
-    
-    float y0 = distsamples[index0];
-    float y1 = distsamples[index1];
-    return y0+(y1-y0)*frac;
-}
+    std::vector<Point> m_points;
+    bool m_periodic[DS_Last];
+    float m_growth[DS_Last];
+};
+
+// First order antiderivative anti-aliased version of the table shapers. The output is the
+// average of the shaper over the line between the previous input and the current one, which
+// delays the output by half a sample. The antiderivatives of the previous input are reused
+// while the distortion type doesn't change.
+class DistortionADAA
+{
+public:
+    simd::float_4 process(const ShaperTables& tables, simd::float_4 in, simd::float_4 type)
+    {
+        // a NaN kept as the previous input would make the following outputs NaN too
+        in = ShaperTables::finiteOrZero(in);
+        simd::float_4 offset;
+        simd::float_4 ad = tables.antiderivative(in,type,offset);
+        if (simd::movemask(type == m_prevType) != 15)
+            m_prevAD = tables.antiderivative(m_prevIn,type,m_prevOffset);
+        simd::float_4 dx = in-m_prevIn;
+        // too close to the previous input for the difference quotient to be accurate
+        simd::float_4 nearPrev = simd::fabs(dx)<1.0e-3f;
+        simd::float_4 result = ((ad-m_prevAD)+(offset-m_prevOffset))/simd::ifelse(nearPrev,1.0f,dx);
+        if (simd::movemask(nearPrev))
+            result = simd::ifelse(nearPrev,tables.process(0.5f*(in+m_prevIn),type),result);
+        m_prevIn = in;
+        m_prevAD = ad;
+        m_prevOffset = offset;
+        m_prevType = type;
+        return result;
+    }
+private:
+    simd::float_4 m_prevIn = 0.0f;
+    simd::float_4 m_prevAD = 0.0f;
+    simd::float_4 m_prevOffset = 0.0f;
+    simd::float_4 m_prevType = -1.0f;
+};
 
 inline float getBitDepthFromNormalized(float x)
 {
@@ -252,49 +506,248 @@ inline float getBitDepthFromNormalized(float x)
     return 16.0f;           
 }
 
+inline simd::float_4 getBitDepthFromNormalized(simd::float_4 x)
+{
+    simd::float_4 result = 2.0f+(x-0.1f)*(5.0f/0.8f);
+    result = simd::ifelse(x<0.1f,1.0f+x*10.0f,result);
+    result = simd::ifelse(x>0.9f,7.0f+(x-0.9f)*90.0f,result);
+    return result;
+}
+
+// Processes 4 channels, one per float_4 lane
 class LOFIEngine
 {
 public:
-    LOFIEngine()
+    LOFIEngine() : m_tables(ShaperTables::get())
     {}
-    float process(float in, float insamplerate, float srdiv, float bits, 
-        float drive, float dtype, float oversample, float glitchrate, float dcoffs)
+    simd::float_4 process(simd::float_4 in, float insamplerate, simd::float_4 srdiv, simd::float_4 bits, 
+        simd::float_4 drive, simd::float_4 dtype, simd::float_4 oversample, simd::float_4 glitchrate, 
+        simd::float_4 dcoffs)
     {
         in+=dcoffs;
-        float driven = drive*in;
-        float oversampledriven = 0.0f;
-        if (oversample>0.0f) // only oversample when oversampled signal is going to be mixed in
+        simd::float_4 driven = drive*in;
+        simd::float_4 oversampledriven = 0.0f;
+        if (simd::movemask(oversample>0.0f)) // only oversample when oversampled signal is going to be mixed in
         {
-            float osarr[8];
+            simd::float_4 osarr[8];
             m_upsampler.process(driven,osarr);
             for (int i=0;i<8;++i)
-                osarr[i] = distort(osarr[i],1.0f,dtype,m_randshaper);
+                osarr[i] = m_tables.process(osarr[i],dtype);
             oversampledriven = 2.0f*m_downsampler.process(osarr);
         }
         
-        driven = distort(driven,1.0f,dtype,m_randshaper);
-        float drivemix = (1.0f-oversample) * driven + oversample * oversampledriven;
+        if (m_antiAliasing)
+            driven = m_adaa.process(m_tables,driven,dtype);
+        else
+            driven = m_tables.process(driven,dtype);
+        simd::float_4 drivemix = (1.0f-oversample) * driven + oversample * oversampledriven;
         m_reducer.setRates(insamplerate,insamplerate/srdiv);
-        float reduced = m_reducer.process(drivemix);
+        m_reducer.setBandLimited(m_bandLimitedHold);
+        simd::float_4 reduced = m_reducer.process(drivemix);
         bits = getBitDepthFromNormalized(bits);
-        float bitlevels = std::pow(2.0f,bits)/2.0f;
-        float crushed = reduced; //*32767.0;
-        crushed = std::round(crushed*bitlevels)/bitlevels;
-        //crushed /= 32767.0;
-        float glitch = m_glitcher.process(crushed,insamplerate,glitchrate);
-        // glitch-=dcoffs;
-        return clamp(glitch,-1.0f,1.0f);
-    }
-    bool glitchActive() { return m_glitcher.glitchActive(); }
-    RandShaper m_randshaper;
+        simd::float_4 bitlevels = simd::exp(bits*std::log(2.0f))/2.0f;
+        simd::float_4 crushed = simd::round(reduced*bitlevels)/bitlevels;
+        simd::float_4 glitch;
+        for (int i=0;i<4;++i)
+            glitch[i] = m_glitchers[i].process(crushed[i],insamplerate,glitchrate[i]);
+        return simd::clamp(glitch,-1.0f,1.0f);
+    }
+    bool glitchActive(int lane) { return m_glitchers[lane].glitchActive(); }
+    // antiderivative anti-aliasing for the shaper that isn't oversampled
+    bool m_antiAliasing = true;
+    // minBLEP steps for the sample rate reduction
+    bool m_bandLimitedHold = false;
 private:
+    const ShaperTables& m_tables;
+    DistortionADAA m_adaa;
     SampleRateReducer m_reducer;
-    dsp::Upsampler<8,2> m_upsampler;
-    dsp::Decimator<8,2> m_downsampler;
-    GlitchGenerator m_glitcher;
+    dsp::Upsampler<8,2,simd::float_4> m_upsampler;
+    dsp::Decimator<8,2,simd::float_4> m_downsampler;
+    GlitchGenerator m_glitchers[4];
     
 };
 
+// Single producer, single consumer queue that doesn't block or allocate. Size must be a power of 2.
+template<typename T, size_t Size>
+class SPSCRingBuffer
+{
+public:
+    // Returns false if the queue is full
+    bool push(T x)
+    {
+        size_t w = m_write.load(std::memory_order_relaxed);
+        if (w-m_read.load(std::memory_order_acquire)>=Size)
+            return false;
+        m_data[w & (Size-1)] = x;
+        m_write.store(w+1,std::memory_order_release);
+        return true;
+    }
+    // Returns how many values were popped
+    size_t pop(T* dest, size_t maxcount)
+    {
+        size_t r = m_read.load(std::memory_order_relaxed);
+        size_t n = std::min(m_write.load(std::memory_order_acquire)-r,maxcount);
+        for (size_t i=0;i<n;++i)
+            dest[i] = m_data[(r+i) & (Size-1)];
+        m_read.store(r+n,std::memory_order_release);
+        return n;
+    }
+private:
+    T m_data[Size];
+    std::atomic<size_t> m_write{0};
+    std::atomic<size_t> m_read{0};
+};
+
+// Spectral analysis on a worker thread. The audio thread only pushes samples into the queue
+// and reads the latest results. The FFT frames overlap by 75%.
+class SpectrumAnalyzer
+{
+public:
+    static const int FFTSize = 2048;
+    static const int HopSize = 512;
+    SpectrumAnalyzer()
+    {
+        m_history.resize(FFTSize);
+        m_window.resize(FFTSize,1.0f);
+        dsp::hannWindow(m_window.data(),FFTSize);
+        m_fftbuffer.resize(FFTSize*2);
+        m_mag_array.resize(FFTSize/2);
+        m_displayMags.resize(FFTSize/2);
+        m_prevMags.resize(FFTSize/2);
+        m_thread = std::thread([this](){ analysisLoop(); });
+    }
+    ~SpectrumAnalyzer()
+    {
+        m_stop = true;
+        m_thread.join();
+    }
+    // Called from the audio thread, samples are dropped if the worker falls behind
+    void pushSample(float x, float samplerate)
+    {
+        m_sampleRate.store(samplerate,std::memory_order_relaxed);
+        m_queue.push(x);
+    }
+    // 0..1, from the number of spectral peaks
+    std::atomic<float> m_complexity{0.0f};
+    // volts per octave relative to C4
+    std::atomic<float> m_centroid{0.0f};
+    // 0 for tonal, 1 for white noise
+    std::atomic<float> m_flatness{0.0f};
+    // 0..1, how much the spectrum grew since the previous frame
+    std::atomic<float> m_flux{0.0f};
+    // For debugging displays, copies the magnitudes of the latest frame and returns
+    // the number of peaks found in it
+    int getDisplayData(std::vector<float>& mags)
+    {
+        std::lock_guard<std::mutex> locker(m_displayMut);
+        mags = m_displayMags;
+        return m_displayPeaks;
+    }
+private:
+    void analysisLoop()
+    {
+        float chunk[HopSize];
+        while (!m_stop)
+        {
+            size_t n = m_queue.pop(chunk,HopSize-m_hopCounter);
+            if (n == 0)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                continue;
+            }
+            for (size_t i=0;i<n;++i)
+            {
+                m_history[m_historyPos] = chunk[i];
+                m_historyPos = (m_historyPos+1) % FFTSize;
+            }
+            m_hopCounter += n;
+            if (m_hopCounter>=HopSize)
+            {
+                m_hopCounter = 0;
+                analyzeFrame();
+            }
+        }
+    }
+    void analyzeFrame()
+    {
+        for (int i=0;i<FFTSize;++i)
+            m_fftbuffer[i] = m_history[(m_historyPos+i) % FFTSize]*m_window[i];
+        m_fft.rfft(m_fftbuffer.data(),m_fftbuffer.data());
+        m_fft.scale(m_fftbuffer.data());
+        const int maglen = FFTSize/2;
+        float magsum = 0.0f;
+        float weightedsum = 0.0f;
+        float powersum = 0.0f;
+        float logpowersum = 0.0f;
+        float growth = 0.0f;
+        for (int i=0;i<maglen;++i)
+        {
+            float re = m_fftbuffer[i*2];
+            float im = m_fftbuffer[i*2+1];
+            float power = re*re+im*im;
+            float mag = std::sqrt(power);
+            magsum += mag;
+            weightedsum += mag*i;
+            powersum += power;
+            logpowersum += std::log(power+1.0e-20f);
+            float diff = mag-m_prevMags[i];
+            if (diff>0.0f)
+                growth += diff*diff;
+            m_prevMags[i] = mag;
+            if (mag>0.001)
+                m_mag_array[i]=mag;
+            else m_mag_array[i]=0.0f;
+        }
+        int numpeaks = 0;
+        for (int i=1;i<maglen-1;++i)
+        {
+            float s0 = m_mag_array[i-1];
+            float s1 = m_mag_array[i];
+            float s2 = m_mag_array[i+1];
+            if (s1>s0 && s1>s2)
+                ++numpeaks;
+        }
+        {
+            std::lock_guard<std::mutex> locker(m_displayMut);
+            m_displayMags = m_mag_array;
+            m_displayPeaks = numpeaks;
+        }
+        float complexity = rescale((float)numpeaks,0,300,0.0f,1.0f);
+        complexity = clamp(complexity,0.0f,1.0f);
+        m_complexity = 1.0f-std::pow(1.0f-complexity,2.0f);
+        if (powersum<1.0e-12f)
+        {
+            // silence, the centroid stays where it was
+            m_flatness = 0.0f;
+            m_flux = 0.0f;
+            return;
+        }
+        float centroidhz = weightedsum/magsum*m_sampleRate.load(std::memory_order_relaxed)/FFTSize;
+        float volts = std::log2(std::max(centroidhz,1.0f)/dsp::FREQ_C4);
+        m_centroid = clamp(volts,-5.0f,5.0f);
+        float geomean = std::exp(logpowersum/maglen);
+        m_flatness = clamp(geomean/(powersum/maglen),0.0f,1.0f);
+        m_flux = clamp(std::sqrt(growth/powersum),0.0f,1.0f);
+    }
+    SPSCRingBuffer<float,16384> m_queue;
+    std::atomic<float> m_sampleRate{44100.0f};
+    std::atomic<bool> m_stop{false};
+    // the rest is only used by the worker
+    std::vector<float> m_history;
+    int m_historyPos = 0;
+    int m_hopCounter = 0;
+    std::vector<float> m_window;
+    std::vector<float> m_fftbuffer;
+    std::vector<float> m_prevMags;
+    std::vector<float> m_mag_array;
+    dsp::RealFFT m_fft{FFTSize};
+    // the latest frame for the displays, the worker only holds the lock while copying
+    std::mutex m_displayMut;
+    std::vector<float> m_displayMags;
+    int m_displayPeaks = 0;
+    std::thread m_thread;
+};
+
 class XLOFI : public rack::Module
 {
 public:
@@ -330,6 +783,9 @@ public:
         OUT_AUDIO,
         OUT_GLITCH_TRIG,
         OUT_SIGNALCOMPLEXITY,
+        OUT_SPECTRALCENTROID,
+        OUT_SPECTRALFLATNESS,
+        OUT_SPECTRALFLUX,
         LAST_OUTPUT
     };
     XLOFI()
@@ -347,112 +803,116 @@ public:
         configParam(PAR_ATTN_OVERSAMPLE,-1.0f,1.0f,0.0,"Distortion oversampling mix CV");
         configParam(PAR_GLITCHRATE,0.0f,1.0f,0.5,"Glitch rate");
         configParam(PAR_ATTN_GLITCHRATE,-1.0f,1.0f,0.0,"Glitch rate CV");
-        m_fftbuffer.resize(4096);
-        m_mag_array.resize(4096);
-        m_smoother.setAmount(0.9995);
+        for (int i=0;i<4;++i)
+            m_smoothers[i].setAmount(0.9995);
     }
     
-    float complexity = 0.0f;
-    int m_numPeaks = 0;
     void process(const ProcessArgs& args) override
     {
-        float insample = inputs[IN_AUDIO].getVoltageSum()/5.0f;
-        if (outputs[OUT_SIGNALCOMPLEXITY].isConnected())
+        bool analyze = false;
+        for (int i=OUT_SIGNALCOMPLEXITY;i<=OUT_SPECTRALFLUX;++i)
+            analyze |= outputs[i].isConnected();
+        if (analyze)
         {
-            m_fftbuffer[m_fftcounter] = insample;
-            ++m_fftcounter;
-            if (m_fftcounter>=m_fft.length)
-            {
-                m_fftcounter = 0;
-                dsp::hannWindow(m_fftbuffer.data(),m_fft.length);
-                m_fft.rfft(m_fftbuffer.data(),m_fftbuffer.data());
-                m_fft.scale(m_fftbuffer.data());
-                int numpeaks = 0;
-                int maglen = m_fft.length/2;
-                for (int i=0;i<maglen;++i)
-                {
-                    float re = m_fftbuffer[i*2];
-                    float im = m_fftbuffer[i*2+1];
-                    float mag = (sqrt(re*re+im*im));
-                    if (mag>0.001)
-                        m_mag_array[i]=mag;
-                    else m_mag_array[i]=0.0f;
-                }
-                for (int i=1;i<maglen-1;++i)
-                {
-                    float s0 = m_mag_array[i-1];
-                    float s1 = m_mag_array[i];
-                    float s2 = m_mag_array[i+1];
-                    if (s1>s0 && s1>s2)
-                        ++numpeaks;
-                }
-                m_numPeaks = numpeaks;
-                complexity = rescale((float)numpeaks,0,300,0.0f,1.0f);
-                complexity = clamp(complexity,0.0f,1.0f);
-                complexity = 1.0f-std::pow(1.0f-complexity,2.0f);
-                
-            }
-            float smoothed = m_smoother.process(complexity);
-            outputs[OUT_SIGNALCOMPLEXITY].setVoltage(smoothed*10.0f);
+            m_analyzer.pushSample(inputs[IN_AUDIO].getVoltageSum()/5.0f,args.sampleRate);
+            outputs[OUT_SIGNALCOMPLEXITY].setVoltage(m_smoothers[0].process(m_analyzer.m_complexity)*10.0f);
+            outputs[OUT_SPECTRALCENTROID].setVoltage(m_smoothers[1].process(m_analyzer.m_centroid));
+            outputs[OUT_SPECTRALFLATNESS].setVoltage(m_smoothers[2].process(m_analyzer.m_flatness)*10.0f);
+            outputs[OUT_SPECTRALFLUX].setVoltage(m_smoothers[3].process(m_analyzer.m_flux)*10.0f);
         }
         if (!outputs[OUT_AUDIO].isConnected())
             return;
-        float drivegain = params[PAR_DRIVE].getValue();
-        drivegain += inputs[IN_CV_DRIVE].getVoltage()*params[PAR_ATTN_DRIVE].getValue()/10.0f;
-        drivegain = clamp(drivegain,0.0f,1.0f);
-        drivegain = rescale(drivegain,0.0f,1.0f,-12.0,52.0f);
-        drivegain = dsp::dbToAmplitude(drivegain);
-        float dtype = params[PAR_DISTORTTYPE].getValue();
-        dtype += inputs[IN_CV_DISTTYPE].getVoltage()*params[PAR_ATTN_DISTYPE].getValue()/3.0f;
-        dtype = clamp(dtype,0.0f,5.0f);
-        float srdiv = params[PAR_RATEDIV].getValue(); 
-        srdiv += inputs[IN_CV_RATEDIV].getVoltage()*params[PAR_ATTN_RATEDIV].getValue()/10.0f;
-        srdiv = clamp(srdiv,0.0f,1.0f);
-        srdiv = std::pow(srdiv,2.0f);
-        srdiv = 1.0+srdiv*99.0;
-        float bits = params[PAR_BITDIV].getValue();
-        float dcoffs = 0.0f;
-        if (inputs[IN_CV_BITDIV].isConnected())
-        {
-            bits += inputs[IN_CV_BITDIV].getVoltage()*params[PAR_ATTN_BITDIV].getValue()/10.0f;
-            bits = clamp(bits,0.0f,1.0f);
-        }
-        
-        float osamt = params[PAR_OVERSAMPLE].getValue();
-        if (inputs[IN_CV_OVERSAMPLE].isConnected())
+        int numchans = std::max(1,inputs[IN_AUDIO].getChannels());
+        outputs[OUT_AUDIO].setChannels(numchans);
+        outputs[OUT_GLITCH_TRIG].setChannels(numchans);
+        bool bitsCVConnected = inputs[IN_CV_BITDIV].isConnected();
+        bool osCVConnected = inputs[IN_CV_OVERSAMPLE].isConnected();
+        bool antiAliasing = m_antiAliasing;
+        bool bandLimitedHold = m_bandLimitedHold;
+        for (int c=0;c<numchans;c+=4)
         {
-            osamt += inputs[IN_CV_OVERSAMPLE].getVoltage()*params[PAR_ATTN_OVERSAMPLE].getValue()/10.0f;
-            osamt = clamp(osamt,0.0f,1.0f);
-        } else
-        {
-            dcoffs = 0.5f*params[PAR_ATTN_OVERSAMPLE].getValue();
-        }
+            simd::float_4 insample = inputs[IN_AUDIO].getPolyVoltageSimd<simd::float_4>(c)/5.0f;
+            simd::float_4 drivegain = params[PAR_DRIVE].getValue();
+            drivegain += inputs[IN_CV_DRIVE].getPolyVoltageSimd<simd::float_4>(c)*params[PAR_ATTN_DRIVE].getValue()/10.0f;
+            drivegain = simd::clamp(drivegain,0.0f,1.0f);
+            drivegain = -12.0f+drivegain*64.0f;
+            drivegain = simd::exp(drivegain*(std::log(10.0f)/20.0f));
+            simd::float_4 dtype = params[PAR_DISTORTTYPE].getValue();
+            dtype += inputs[IN_CV_DISTTYPE].getPolyVoltageSimd<simd::float_4>(c)*params[PAR_ATTN_DISTYPE].getValue()/3.0f;
+            dtype = simd::clamp(dtype,0.0f,5.0f);
+            simd::float_4 srdiv = params[PAR_RATEDIV].getValue(); 
+            srdiv += inputs[IN_CV_RATEDIV].getPolyVoltageSimd<simd::float_4>(c)*params[PAR_ATTN_RATEDIV].getValue()/10.0f;
+            srdiv = simd::clamp(srdiv,0.0f,1.0f);
+            srdiv = srdiv*srdiv;
+            srdiv = 1.0f+srdiv*99.0f;
+            simd::float_4 bits = params[PAR_BITDIV].getValue();
+            simd::float_4 dcoffs = 0.0f;
+            if (bitsCVConnected)
+            {
+                bits += inputs[IN_CV_BITDIV].getPolyVoltageSimd<simd::float_4>(c)*params[PAR_ATTN_BITDIV].getValue()/10.0f;
+                bits = simd::clamp(bits,0.0f,1.0f);
+            }
+            
+            simd::float_4 osamt = params[PAR_OVERSAMPLE].getValue();
+            if (osCVConnected)
+            {
+                osamt += inputs[IN_CV_OVERSAMPLE].getPolyVoltageSimd<simd::float_4>(c)*params[PAR_ATTN_OVERSAMPLE].getValue()/10.0f;
+                osamt = simd::clamp(osamt,0.0f,1.0f);
+            } else
+            {
+                dcoffs = 0.5f*params[PAR_ATTN_OVERSAMPLE].getValue();
+            }
 
-        
-        float glitchrate = params[PAR_GLITCHRATE].getValue();
-        glitchrate += inputs[IN_CV_GLITCHRATE].getVoltage()*params[PAR_ATTN_GLITCHRATE].getValue()/10.0f;
-        glitchrate = clamp(glitchrate,0.0f,1.0f);
-        float processed = m_engines[0].process(insample,args.sampleRate,srdiv,bits,drivegain,dtype,osamt,
-            glitchrate,dcoffs);
-        outputs[OUT_AUDIO].setVoltage(processed*5.0f);
-        if (outputs[OUT_GLITCH_TRIG].isConnected())
-        {
-            if (m_engines[0].glitchActive())
-                outputs[OUT_GLITCH_TRIG].setVoltage(5.0f);
-            else 
-                outputs[OUT_GLITCH_TRIG].setVoltage(0.0f);
+            
+            simd::float_4 glitchrate = params[PAR_GLITCHRATE].getValue();
+            glitchrate += inputs[IN_CV_GLITCHRATE].getPolyVoltageSimd<simd::float_4>(c)*params[PAR_ATTN_GLITCHRATE].getValue()/10.0f;
+            glitchrate = simd::clamp(glitchrate,0.0f,1.0f);
+            LOFIEngine& eng = m_engines[c/4];
+            eng.m_antiAliasing = antiAliasing;
+            eng.m_bandLimitedHold = bandLimitedHold;
+            simd::float_4 processed = eng.process(insample,args.sampleRate,srdiv,bits,drivegain,dtype,osamt,
+                glitchrate,dcoffs);
+            outputs[OUT_AUDIO].setVoltageSimd(processed*5.0f,c);
+            if (outputs[OUT_GLITCH_TRIG].isConnected())
+            {
+                for (int i=0;i<4;++i)
+                    outputs[OUT_GLITCH_TRIG].setVoltage(eng.glitchActive(i) ? 5.0f : 0.0f,c+i);
+            }
         }
     }
-    std::vector<float> m_mag_array;
-    dsp::RealFFT m_fft{2048};
+    json_t* dataToJson() override
+    {
+        json_t* resultJ = json_object();
+        json_object_set(resultJ,"antialiasing",json_boolean(m_antiAliasing));
+        json_object_set(resultJ,"bandlimitedhold",json_boolean(m_bandLimitedHold));
+        return resultJ;
+    }
+    void fromJson(json_t* root) override
+    {
+        // patches saved before the module had any data keep their original sound,
+        // dataFromJson isn't called for those
+        if (!json_object_get(root,"data"))
+            m_antiAliasing = false;
+        Module::fromJson(root);
+    }
+    void dataFromJson(json_t* root) override
+    {
+        json_t* aaJ = json_object_get(root,"antialiasing");
+        if (aaJ)
+            m_antiAliasing = json_is_true(aaJ);
+        json_t* blJ = json_object_get(root,"bandlimitedhold");
+        if (blJ)
+            m_bandLimitedHold = json_is_true(blJ);
+    }
+    std::atomic<bool> m_antiAliasing{true};
+    std::atomic<bool> m_bandLimitedHold{false};
+    SpectrumAnalyzer m_analyzer;
 private:
     
-    LOFIEngine m_engines[16];
-    
-    std::vector<float> m_fftbuffer;
-    
-    int m_fftcounter = 0;
-    OnePoleFilter m_smoother;
+    // 4 channels each
+    LOFIEngine m_engines[4];
+    // for the analysis outputs
+    OnePoleFilter m_smoothers[4];
 };
 
 extern std::shared_ptr<Font> g_font;
@@ -470,13 +930,13 @@ class XLOFIWidget : public ModuleWidget
 {
 public:
     XLOFI* m_lofi = nullptr;
-    LOFIEngine m_eng;
     std::shared_ptr<rack::Font> m_font;
+    std::vector<float> m_mags;
     XLOFIWidget(XLOFI* m)
     {
         setModule(m);
         m_lofi = m;
-        box.size.x = 87;
+        box.size.x = 117;
         auto font = APP->window->loadFont(asset::plugin(pluginInstance, "res/Nunito-Bold.ttf"));
         m_font = font;
 
@@ -496,6 +956,14 @@ public:
         xoffs = port->box.getRight()+5;
         addOutput(port = createOutput<PortWithBackGround<PJ301MPort>>(Vec(xoffs, yoffs), m, XLOFI::OUT_GLITCH_TRIG));
         port->m_text = "GLITCH ACTIVE";
+        const char* analysisnames[3] = {"CENTROID","FLATNESS","FLUX"};
+        for (int i=0;i<3;++i)
+        {
+            auto analysisport = createOutput<PortWithBackGround<PJ301MPort>>(Vec(90, 34+41*i), m, 
+                XLOFI::OUT_SPECTRALCENTROID+i);
+            analysisport->m_text = analysisnames[i];
+            addOutput(analysisport);
+        }
 
         float ydiff = 45.0f;
         yoffs = port->box.pos.y+port->box.size.y+3;
@@ -524,6 +992,19 @@ public:
         addChild(new LabelWidget({{1,6},{box.size.x,1}}, "LOFI",15,nvgRGB(255,255,255),LabelWidget::J_CENTER));
         addChild(new LabelWidget({{1,189},{box.size.x-4.0f,1}}, "Xenakios",10,nvgRGB(255,255,255),LabelWidget::J_RIGHT));
     }
+    void appendContextMenu(Menu *menu) override 
+    {
+        if (!m_lofi)
+            return;
+        bool aa = m_lofi->m_antiAliasing;
+        auto aaItem = createMenuItem([this,aa](){ m_lofi->m_antiAliasing = !aa; },
+            "Antiderivative anti-aliasing",CHECKMARK(aa));
+        menu->addChild(aaItem);
+        bool bl = m_lofi->m_bandLimitedHold;
+        auto blItem = createMenuItem([this,bl](){ m_lofi->m_bandLimitedHold = !bl; },
+            "Band limited sample rate reduction",CHECKMARK(bl));
+        menu->addChild(blItem);
+    }
     int negCount = 0;
     void draw(const DrawArgs &args) override
     {
@@ -538,10 +1019,11 @@ public:
         {
             nvgStrokeColor(args.vg, nvgRGBA(0xff, 0xff, 0xff, 0xff));
             nvgBeginPath(args.vg);
-            int fftlen = m_lofi->m_fft.length/2;
+            int numpeaks = m_lofi->m_analyzer.getDisplayData(m_mags);
+            int fftlen = SpectrumAnalyzer::FFTSize/2;
             for (int i=0;i<fftlen;++i)
             {
-                float s = m_lofi->m_mag_array[i]*4.0f;
+                float s = m_mags[i]*4.0f;
                 if (s<0.0f)
                     ++negCount;
                 float ycor = rescale(s,-1.0f,1.0f,400.0,330.0f);
@@ -553,7 +1035,7 @@ public:
             }
             nvgStroke(args.vg);
             char buf[100];
-            sprintf(buf,"%d %d",m_lofi->m_numPeaks, negCount);
+            sprintf(buf,"%d %d",numpeaks, negCount);
             nvgFontSize(args.vg, 15);
             nvgFontFaceId(args.vg, m_font->handle);
             nvgTextLetterSpacing(args.vg, -1);
@@ -562,37 +1044,6 @@ public:
             nvgText(args.vg, 90 , 375, buf, NULL);
             
         }
-        if (m_lofi && 6==3)
-        {
-            int w = 78*2;
-            float srdiv = m_lofi->params[XLOFI::PAR_RATEDIV].getValue();
-            srdiv = std::pow(srdiv,2.0f);
-            srdiv = 1.0+srdiv*99.0;
-            float bitd = m_lofi->params[XLOFI::PAR_BITDIV].getValue();
-            float drive = m_lofi->params[XLOFI::PAR_DRIVE].getValue();
-            drive = rescale(drive,0.0f,1.0f,-12.0,52.0f);
-            drive = dsp::dbToAmplitude(drive);
-            float dtype = m_lofi->params[XLOFI::PAR_DISTORTTYPE].getValue();
-            nvgStrokeColor(args.vg, nvgRGBA(0xff, 0xff, 0xff, 0x80));
-            nvgBeginPath(args.vg);
-            nvgMoveTo(args.vg,0.0,295.0f);
-            nvgLineTo(args.vg,80.0,295.0f);
-            nvgStroke(args.vg);
-            nvgStrokeColor(args.vg, nvgRGBA(0xff, 0xff, 0xff, 0xff));
-            nvgBeginPath(args.vg);
-            for (int i=0;i<w;++i)
-            {
-                float s = std::sin(2*3.141592653/w*i*2.0f);
-                s = m_eng.process(s,w*2.0f,srdiv,bitd,drive,dtype,0.0f,0.5f,0.0f);
-                float ycor = rescale(s,-1.0f,1.0f,270.0,320.0f);
-                float xcor = rescale(i,0,w,0.0,80.0);
-                nvgMoveTo(args.vg,xcor,295.0f);
-                nvgLineTo(args.vg,xcor,ycor);
-                
-            }
-            nvgStroke(args.vg);
-        }
-        
         nvgRestore(args.vg);
         ModuleWidget::draw(args);
 }